@@ -10,13 +10,25 @@
 #define _GNU_SOURCE
 
 #include <stdnoreturn.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <langinfo.h>
+#include <locale.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
@@ -24,6 +36,10 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <time.h>
+#include <wchar.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define VERSION	"0.1.0"
 
@@ -32,6 +48,23 @@
  */
 #define MAX_COUNT	0x7FFFFF
 #define TAB_SIZE	8
+#define INBUF_SIZE	4096	// Must be a power of two
+#define ESC_TIMEOUT	10	// ms to wait for the rest of an escape sequence (or $ESCDELAY)
+#define PASTE_TIMEOUT	1000
+#define MSG_TIMEOUT	5	// Seconds a status message stays up
+#define SAVE_IOVS	1024	// iovecs per writev() when saving, at most IOV_MAX
+#define MAX_WORKERS	16	// Threads counting search matches
+#define INDEX_CHUNK	(1 << 20)	// Bytes the line indexer scans between updates
+#define INDEX_WAKE	50	// ms between screen updates while indexing
+#define WIDTH_STEP	256	// Bytes between cached column checkpoints
+#define WIDTH_CACHE	64	// Rows with cached checkpoints
+#define HL_SYNC		1000	// Rows lexed ahead of a jump far past what's been highlighted
+#define HL_MAX_BYTES	4096	// Bytes of a row that get highlighted at most
+#define FILTER_PIPE	(1 << 20)	// Pipe buffer asked for when running a filter
+#define FILTER_READ	(1 << 16)	// Bytes of filter output read at a time
+#define BUFFER_MEMORY	(256 << 20)	// Bytes hidden buffers may hold before clean ones get dropped
+#define VIEW_BLOCKS	64	// Blocks a read-only buffer keeps split into rows
+#define VIEW_RESERVE	(1ull << 36)	// Bytes mapped past the end of a read-only file for it to grow into
 
 typedef uint8_t	 u8;
 typedef uint16_t u16;
@@ -47,10 +80,32 @@ const char* MODE_STR[] = { "NOR", "INS", "CMD", "VIS" };
 
 enum optype { OP_NONE, OP_DELETE, OP_YANK, OP_CHANGE };
 
+// What the highlighter colours a byte as, and the state a row can leave it
+// in. HL_UNKNOWN marks a row that was never lexed.
+enum hl_class { HL_NORMAL, HL_COMMENT, HL_KEYWORD, HL_TYPE, HL_STRING, HL_NUMBER, HL_PREPROC };
+enum hl_state { HS_NORMAL, HS_COMMENT, HL_UNKNOWN = 0xFF };
+const char* HL_COLOR[] = { "39", "36", "33", "32", "35", "31", "34" };
+
+// Undo records come in inverse pairs, so op ^ 1 undoes op
+enum undo_op { U_ROWS_INSERT, U_ROWS_DELETE, U_TEXT_INSERT, U_TEXT_DELETE };
+
 typedef struct { u32 x, y; } pos_t;
+struct abuf { char* b; u32 len, cap; };
+
+// A register is a list of row pieces. Pieces of unmodified rows point
+// into the file mapping instead of being copied.
+struct span { u64 off; u32 len; bool mapped; };
+struct reg { bool linewise; struct span* spans; u32 count, cap; struct abuf own; };
+
+// Identifies the version of a file a buffer was read from
+struct fstamp { dev_t dev; ino_t ino; off_t size; struct timespec mtime; };
+
 typedef pos_t (*motion_fn)(pos_t start, u32 count);
 motion_fn motions[128];
 
+enum { MF_LINEWISE = 1 };
+u8 motion_flags[128];
+
 static struct editor {
 	u8 mode;
 	u8 pending_op;
@@ -59,13 +114,56 @@ static struct editor {
 	u32 rx, ry;
 	u32 screen_rows, screen_cols;
 	u32 row_offset, col_offset;
+	u32 row_sub;
+	bool wrap;
 	u32 row_count;
-	struct erow* rows;
+	struct rblock** blocks;
+	u32 block_count, block_cap;
+	u32 last_block, last_first;
 	bool dirty;
 	char* filename;
+	struct fstamp stamp;
+	char* map;
+	u64 map_len, map_size;
+	bool view, follow;
+	int watch;
+	u32 row_blocks;
+	int swap;
+	bool noswap, dying;
 	char statusmsg[80];
 	time_t statusmsg_time;
+	struct abuf frame, line;
+	struct abuf* shown;
+	u32 shown_lines, shown_row_offset, shown_col_offset, shown_row_sub;
+	u32 damage_lo, damage_hi;
 	struct termios orig_termios;
+	char inbuf[INBUF_SIZE];
+	u32 in_head, in_tail;
+	int esc_timeout;
+	int wake_pipe[2];
+	struct urec* urecs;
+	u32 urec_count, urec_cap;
+	u32* usteps;
+	u32 ustep_count, ustep_cap;
+	u32 ustep_pos, ustep_saved;
+	bool ustep_open, undoing;
+	struct abuf utext;
+	struct reg reg;
+	char* search_str;
+	char* search;
+	u32 search_len;
+	bool search_back;
+	u32 search_gen;
+	bool match_ready;
+	struct mslot* match_index;
+	struct lindex* index;
+	bool partial;
+	bool headless;
+	u32 width_gen;
+	const struct syntax* syntax;
+	u32 hl_lo, hl_hi, hl_top;
+	u32 hl_sync_lo, hl_sync_hi;
+	struct abuf hl_buf;
 } E;
 
 // Special keys
@@ -82,6 +180,11 @@ enum {
 	END,
 	PAGE_UP,
 	PAGE_DOWN,
+	INSERT,
+	BACKTAB,
+	F1, F2, F3, F4, F5, F6, F7, F8, F9, F10, F11, F12,
+	PASTE_BEGIN,
+	PASTE_END,
 };
 
 /*
@@ -89,6 +192,17 @@ enum {
  */
 #define CTRL_KEY(_k) ((_k) & 0x1F)
 
+// Character classes for word motions and the highlighter. Like vi, a word
+// is a run of letters, digits and underscores or a run of other non-blank
+// characters. Bytes above 0x7f count as letters so UTF-8 text stays in
+// one word.
+enum { CC_PUNCT, CC_BLANK, CC_WORD };
+static const u8 char_class[256] = {
+	['\t'] = CC_BLANK, ['\v'] = CC_BLANK, ['\f'] = CC_BLANK, ['\r'] = CC_BLANK, [' '] = CC_BLANK,
+	['0' ... '9'] = CC_WORD, ['A' ... 'Z'] = CC_WORD, ['_'] = CC_WORD, ['a' ... 'z'] = CC_WORD,
+	[0x80 ... 0xff] = CC_WORD,
+};
+
 noreturn
 static void die(const char* s) {
 	fprintf(
@@ -97,429 +211,3783 @@ static void die(const char* s) {
 		"%s: %s\n",
 		s, strerror(errno)
 	       );
+	E.dying = true;
 	exit(1);
 }
 
-struct abuf { char* b; u32 len; };
+// Buffers grow by doubling and are meant to be reset and reused, so a
+// frame that fits in the last one's space doesn't allocate at all
+static void ab_reserve(struct abuf* ab, u32 len) {
+	if (ab->len + len <= ab->cap) return;
 
-static void ab_append(struct abuf* ab, const char* s, u32 len) {
-	char* new = realloc(ab->b, ab->len + len);
+	u32 cap = ab->cap ? ab->cap : 256;
+	while (cap < ab->len + len) cap *= 2;
+
+	char* new = realloc(ab->b, cap);
 	if (new == NULL) die("realloc");
-	memcpy(&new[ab->len], s, len);
 	ab->b = new;
+	ab->cap = cap;
+}
+
+static void ab_append(struct abuf* ab, const char* s, u32 len) {
+	ab_reserve(ab, len);
+	memcpy(&ab->b[ab->len], s, len);
 	ab->len += len;
 }
 
+static void ab_pad(struct abuf* ab, char c, u32 n) {
+	ab_reserve(ab, n);
+	memset(&ab->b[ab->len], c, n);
+	ab->len += n;
+}
+
 static void ab_free(struct abuf* ab) {
 	free(ab->b);
+	ab->b = NULL;
+	ab->len = ab->cap = 0;
 }
 
-struct erow { u32 len, rlen; char *chars, *render; };
-
-static void row_update(struct erow* row) {
-	u32 tabs = 0;
-	for (u32 i = 0; i < row->len; i++) {
-		if (row->chars[i] == '\t') tabs++;
+// Note that file rows [lo, hi) have changed since the last frame
+static void damage_rows(u32 lo, u32 hi) {
+	if (E.damage_lo >= E.damage_hi) {
+		E.damage_lo = lo;
+		E.damage_hi = hi;
+		return;
 	}
 
-	free(row->render);
-	row->render = malloc(row->len + tabs * (TAB_SIZE - 1) + 1);
-	if (row->render == NULL) die("malloc");
+	if (lo < E.damage_lo) E.damage_lo = lo;
+	if (hi > E.damage_hi) E.damage_hi = hi;
+}
 
-	u32 j = 0;
-	for (u32 i = 0; i < row->len; i++) {
-		if (row->chars[i] == '\t') {
-			row->render[j++] = ' ';
-			while (j % TAB_SIZE != 0) row->render[j++] = ' ';
-		} else row->render[j++] = row->chars[i];
-	}
+/*
+ * Instrumentation
+ *
+ * 'make perf' builds with PERF defined, which times the main entry points
+ * with PERF_SCOPE() and keeps a rolling window of frame times and of how
+ * long input waits to be painted, shown by :perf. With --trace FILE every
+ * timed call is kept and written out as a Chrome trace (chrome://tracing,
+ * Perfetto) on exit. Both PERF and BENCH builds link the allocator calls
+ * through the __wrap_ functions here to count them; allocations made
+ * inside libc, like strdup()'s, aren't seen. Without PERF this all
+ * compiles down to nothing.
+ */
+#if defined(PERF) || defined(BENCH)
+static u64 alloc_count;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
 
-	row->render[j] = '\0';
-	row->rlen = j;
+void* __wrap_malloc(size_t size) {
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
 }
 
-static void row_free(struct erow *row) {
-	free(row->render);
-	free(row->chars);
+void* __wrap_calloc(size_t n, size_t size) {
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __real_calloc(n, size);
 }
 
-static void row_insert(u32 at, char* s, u32 len) {
-	if (at > E.row_count) at = E.row_count;
+void* __wrap_realloc(void* p, size_t size) {
+	__atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+	return __real_realloc(p, size);
+}
+#endif
 
-	E.rows = realloc(E.rows, sizeof(struct erow) * (E.row_count + 1));
-	if (E.rows == NULL) die("realloc");
-	memmove(&E.rows[at + 1], &E.rows[at], sizeof(struct erow) * (E.row_count - at));
-	
-	E.rows[at].len = len;
-	E.rows[at].chars = malloc(len + 1);
-	memcpy(E.rows[at].chars, s, len);
-	E.rows[at].chars[len] = '\0';
+#ifdef PERF
+#define PERF_WINDOW	64	// Frames the :perf figures are taken over
 
-	E.rows[at].rlen = 0;
-	E.rows[at].render = NULL;
-	row_update(&E.rows[at]);
+enum perf_id { P_READ_KEY, P_KEYPRESS, P_REFRESH, P_OPEN, P_SAVE, P_TTY, P_ALLOCS };
+static const char* PERF_NAMES[] = {
+	"read_key", "process_keypress", "refresh_screen", "open_file", "save_file", "tty bytes", "mallocs"
+};
 
-	E.row_count++;
-	E.dirty = true;
+// A timed call, or a counter sample for P_TTY and P_ALLOCS
+struct perf_event { u32 id; u64 ts, dur; };
+struct perf_scope { u32 id; u64 t; };
+
+static struct {
+	bool overlay;
+	char* trace;
+	struct perf_event* events;
+	u32 count, cap;
+	u64 start;
+	u64 input_at;
+	u64 frame[PERF_WINDOW], latency[PERF_WINDOW];
+	u32 frames, inputs;
+	u64 tty, last_write;
+} P;
+
+static u64 perf_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static void row_append_string(struct erow* row, char* s, u32 len) {
-	row->chars = realloc(row->chars, row->len + len + 1);
-	if (row->chars == NULL) die("realloc");
-	memcpy(&row->chars[row->len], s, len);
-	row->len += len;
-	row->chars[row->len] = '\0';
-	row_update(row);
-	E.dirty = true;
+static void perf_event(u32 id, u64 ts, u64 dur) {
+	if (!P.trace) return;
+	if (P.count == P.cap) {
+		P.cap = P.cap ? P.cap * 2 : 4096;
+		P.events = realloc(P.events, sizeof(*P.events) * P.cap);
+		if (P.events == NULL) die("realloc");
+	}
+	P.events[P.count++] = (struct perf_event){ id, ts - P.start, dur };
 }
 
-static void row_insert_char(struct erow* row, u32 at, u32 c) {
-	if (at > row->len) at = row->len;
-	row->chars = realloc(row->chars, row->len + 2);
-	memmove(&row->chars[at + 1], &row->chars[at], row->len - at + 1);
-	row->len++;
-	row->chars[at] = c;
-	row_update(row);
-	E.dirty = true;
+static struct perf_scope perf_enter(u32 id) {
+	return (struct perf_scope){ id, perf_now() };
 }
 
-static void row_delete(u32 at) {
-	if (at >= E.row_count) return;
-	row_free(&E.rows[at]);
-	memmove(&E.rows[at], &E.rows[at + 1], sizeof(struct erow) * (E.row_count - at - 1));
-	E.row_count--;
-	E.dirty = true;
+// A frame also closes the latency of the input it painted and samples the
+// counters
+static void perf_leave(struct perf_scope* s) {
+	u64 now = perf_now();
+	perf_event(s->id, s->t, now - s->t);
+	if (s->id != P_REFRESH) return;
+
+	P.frame[P.frames++ % PERF_WINDOW] = now - s->t;
+	if (P.input_at) {
+		P.latency[P.inputs++ % PERF_WINDOW] = now - P.input_at;
+		P.input_at = 0;
+	}
+	perf_event(P_TTY, now, P.tty);
+	perf_event(P_ALLOCS, now, alloc_count);
 }
 
-static void row_delete_char(struct erow* row, u32 at) {
-	if (at >= row->len) return;
-	memmove(&row->chars[at], &row->chars[at + 1], row->len - at);
-	row->len--;
-	row_update(row);
-	E.dirty = true;
-}
+#define PERF_SCOPE(id) struct perf_scope perf_scope_ __attribute__((cleanup(perf_leave))) = perf_enter(id)
 
-static char* rows_to_string(u32* buflen) {
-	u32 total = 0;
-	for (u32 j = 0; j < E.row_count; j++) total += E.rows[j].len + 1;
-	*buflen = total;
+static void perf_input(void) {
+	if (!P.input_at) P.input_at = perf_now();
+}
 
-	if (total == 0) {
-		*buflen = 0;
-		return NULL;
-	}
+static void perf_written(u32 n) {
+	P.tty += n;
+	P.last_write = n;
+}
 
-	char* buf = malloc(total);
-	if (buf == NULL) die("malloc");
-	char* p = buf;
-	for (u32 j = 0; j < E.row_count; j++) {
-		memcpy(p, E.rows[j].chars, E.rows[j].len);
-		p += E.rows[j].len;
-		*p = '\n';
-		p++;
+// Average and worst of the last PERF_WINDOW samples, in ms
+static void perf_window(const u64* v, u32 n, double* avg, double* max) {
+	if (n > PERF_WINDOW) n = PERF_WINDOW;
+	u64 sum = 0, top = 0;
+	for (u32 i = 0; i < n; i++) {
+		sum += v[i];
+		if (v[i] > top) top = v[i];
 	}
+	*avg = n ? sum / 1e6 / n : 0;
+	*max = top / 1e6;
+}
 
-	return buf;
+static u32 perf_status(char* buf, u32 size) {
+	double fa, fm, la, lm;
+	perf_window(P.frame, P.frames, &fa, &fm);
+	perf_window(P.latency, P.inputs, &la, &lm);
+	return snprintf(buf, size, "frame %.2f/%.2fms  input to paint %.2f/%.2fms  tty %" PRIu64 "B/%" PRIu64 "K  mallocs %" PRIu64,
+		fa, fm, la, lm, P.last_write, P.tty >> 10, alloc_count);
 }
 
-static char get_char_at(pos_t p) {
-	if (p.y >= E.row_count) return '\0';
-	if (p.x >= E.rows[p.y].len) return '\n';
-	return E.rows[p.y].chars[p.x];
+static void perf_dump(void) {
+	FILE* f = fopen(P.trace, "w");
+	if (f == NULL) return;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (u32 i = 0; i < P.count; i++) {
+		struct perf_event* e = &P.events[i];
+		const char* sep = (i + 1 < P.count) ? "," : "";
+		if (e->id == P_TTY || e->id == P_ALLOCS) {
+			fprintf(f, "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"args\":{\"total\":%" PRIu64 "}}%s\n",
+				PERF_NAMES[e->id], e->ts / 1e3, e->dur, sep);
+		} else {
+			fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}%s\n",
+				PERF_NAMES[e->id], e->ts / 1e3, e->dur / 1e3, sep);
+		}
+	}
+	fprintf(f, "]}\n");
+	fclose(f);
+	free(P.events);
 }
 
-static void refresh_screen(void);
-static void statusmsg_set(const char* fmt, ...) {
-	va_list ap;
-	va_start(ap, fmt);
-	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-	va_end(ap);
-	E.statusmsg_time = time(NULL);
-	refresh_screen();
+static void perf_trace(char* path) {
+	P.trace = path;
+	P.start = perf_now();
+	atexit(perf_dump);
 }
+#else
+#define PERF_SCOPE(id) ((void)0)
+static inline void perf_input(void) {}
+static inline void perf_written(u32 n) { (void)n; }
+#endif
 
 /*
- * Terminal functions
+ * Row storage
+ *
+ * Rows are kept in fixed-size blocks, so inserting or deleting a line only
+ * shifts the rows of a single block plus the (much shorter) block table.
+ * Lookups walk the block table from the last block we touched, which keeps
+ * sequential and local access O(1).
  */
-static void disable_raw(void) {
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) die("tcsetattr");
+#define BLOCK_ROWS	512
+
+// A row with cap == 0 borrows its bytes (e.g. from the file mapping) and
+// gets its own copy through row_own() the first time it is modified. Short
+// rows (cap == ROW_INLINE) keep their bytes in the row itself, longer ones
+// get them from the line arena. Go through row_chars() to read them.
+#define ROW_INLINE	16
+struct erow {
+	u32 len, cap;
+	union { char* chars; char inl[ROW_INLINE]; };
+};
+// Blocks also cache where the current search pattern matches in them, as
+// (row in block, column) pairs in order. match_gen == 0 marks the cache stale.
+// A block made by the line indexer starts out lazy: its rows are the 'count'
+// lines of the mapping at [lazy, lazy_end) and only get split out by
+// block_get() when they're first needed. 'bytes' caches how much the rows
+// take up once saved, newlines included; UINT64_MAX marks it stale. The
+// same goes for the bitmap of empty rows and blank_count == UINT32_MAX.
+// hl[] holds the lexer state each row ended in when it was last
+// highlighted, and moves along with the rows themselves. Both only get
+// allocated once a block is split, so a lazy block costs little more than
+// its header.
+struct bmatch { u32 row, x; };
+struct rblock {
+	u32 count;
+	u64 bytes;
+	u32 blank_count;
+	u64 blanks[BLOCK_ROWS / 64];
+	u32 match_gen, match_count;
+	struct bmatch* matches;
+	char* lazy;
+	char* lazy_end;
+	struct erow* rows;
+	u8* hl;
+};
+
+static pthread_mutex_t lazy_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Line arena
+ * Owned row bytes are carved out of big chunks in size classes of
+ * ARENA_ALIGN bytes, each with its own free list, so freed room gets reused
+ * and dropping every row at once only has to free the chunks. Rows too big
+ * for a class get their own allocation, linked in so they go with the rest.
+ */
+#define ARENA_CHUNK	(1 << 16)
+#define ARENA_ALIGN	8
+#define ARENA_MAX	4096	// Largest size carved out of a chunk
+
+struct achunk { struct achunk* next; };
+struct abig { struct abig* prev, *next; };
+
+static struct arena {
+	struct achunk* chunks;
+	char* next;
+	char* end;
+	void* free[ARENA_MAX / ARENA_ALIGN];
+	struct abig* big;
+	u64 size;		// Bytes allocated for chunks and big rows
+} A;
+
+// 'cap' is a multiple of ARENA_ALIGN
+static char* arena_alloc(u32 cap) {
+	if (cap > ARENA_MAX) {
+		struct abig* big = malloc(sizeof(*big) + cap);
+		if (big == NULL) die("malloc");
+		A.size += sizeof(*big) + cap;
+		big->prev = NULL;
+		big->next = A.big;
+		if (A.big) A.big->prev = big;
+		A.big = big;
+		return (char*)(big + 1);
+	}
+
+	void** slot = &A.free[cap / ARENA_ALIGN - 1];
+	if (*slot != NULL) {
+		char* p = *slot;
+		*slot = *(void**)p;
+		return p;
+	}
+
+	if ((u32)(A.end - A.next) < cap) {
+		struct achunk* c = malloc(sizeof(*c) + ARENA_CHUNK);
+		if (c == NULL) die("malloc");
+		A.size += sizeof(*c) + ARENA_CHUNK;
+		c->next = A.chunks;
+		A.chunks = c;
+		A.next = (char*)(c + 1);
+		A.end = A.next + ARENA_CHUNK;
+	}
+
+	char* p = A.next;
+	A.next += cap;
+	return p;
 }
 
-static void enable_raw(void) {
-	if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) die("tcgetattr");
+static void arena_free(char* p, u32 cap) {
+	if (cap > ARENA_MAX) {
+		struct abig* big = (struct abig*)p - 1;
+		if (big->prev) big->prev->next = big->next;
+		else A.big = big->next;
+		if (big->next) big->next->prev = big->prev;
+		A.size -= sizeof(*big) + cap;
+		free(big);
+		return;
+	}
 
-	struct termios raw = E.orig_termios;
-	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
-	raw.c_oflag &= ~(OPOST);
-	raw.c_cflag |= (CS8);
-	raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
-	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	void** slot = &A.free[cap / ARENA_ALIGN - 1];
+	*(void**)p = *slot;
+	*slot = p;
+}
 
-	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+static void arena_reset(void) {
+	while (A.chunks) {
+		struct achunk* c = A.chunks;
+		A.chunks = c->next;
+		free(c);
+	}
+	while (A.big) {
+		struct abig* big = A.big;
+		A.big = big->next;
+		free(big);
+	}
+	memset(&A, 0, sizeof(A));
 }
 
-static u32 read_key(void) {
-	ssize_t nread;
-	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) die("read");
-	}
-
-	// TODO: Make this escape bullshit parsing prettier
-	if (c == '\x1b') {
-		char seq[3];
-
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-		if (seq[0] == '[') {
-			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-				if (seq[2] == '~') {
-					switch (seq[1]) {
-					case '1': return HOME;
-					case '3': return DELETE;
-					case '4': return END;
-					case '5': return PAGE_UP;
-					case '6': return PAGE_DOWN;
-					case '7': return HOME;
-					case '8': return END;
-					default: return '\x1b';
-					}
-				}
-			}
+static void undo_record(u8 op, u32 y, u32 x, const char* s, u32 len);
+static void undo_extend(const char* s, u32 len);
+static void swap_log(u8 op, u32 y, u32 x, const char* s, u32 len);
+static void match_stop(void);
+static void index_wait(u32 y);
+static void hl_edited(u32 y, i32 shift);
+static void width_edited(u32 y, u32 x);
+static void follow_update(void);
+static void swap_kick(void);
+static void swap_remove(void);
+static void swap_recover(void);
+static void buffer_reload(void);
+
+static u32 block_find(u32 at, u32* first) {
+	u32 b = E.last_block, f = E.last_first;
+	if (b >= E.block_count) b = f = 0;
+
+	while (b > 0 && at < f) f -= E.blocks[--b]->count;
+	while (b + 1 < E.block_count && at >= f + E.blocks[b]->count) f += E.blocks[b++]->count;
+
+	E.last_block = b;
+	E.last_first = f;
+	*first = f;
+	return b;
+}
 
-			switch (seq[1]) {
-			case 'A': return ARROW_UP;
-			case 'B': return ARROW_DOWN;
-			case 'C': return ARROW_RIGHT;
-			case 'D': return ARROW_LEFT;
-			case 'F': return END;
-			case 'H': return HOME;
-			}
-		} else if (seq[0] == 'O') {
-			switch (seq[1]) {
-			case 'F': return END;
-			case 'H': return HOME;
-			}
-		} 
+static struct rblock* block_insert(u32 b) {
+	if (E.block_count == E.block_cap) {
+		E.block_cap = E.block_cap ? E.block_cap * 2 : 16;
+		E.blocks = realloc(E.blocks, sizeof(*E.blocks) * E.block_cap);
+		if (E.blocks == NULL) die("realloc");
 	}
 
-	return c;
+	struct rblock* blk = malloc(sizeof(*blk));
+	if (blk == NULL) die("malloc");
+	blk->count = 0;
+	blk->bytes = UINT64_MAX;
+	blk->blank_count = UINT32_MAX;
+	blk->match_gen = 0;
+	blk->matches = NULL;
+	blk->lazy = NULL;
+	blk->rows = NULL;
+	blk->hl = NULL;
+
+	memmove(&E.blocks[b + 1], &E.blocks[b], sizeof(*E.blocks) * (E.block_count - b));
+	E.blocks[b] = blk;
+	E.block_count++;
+	return blk;
 }
 
-static u8 get_cursor_pos(u32* row, u32* col) {
-	char buf[32];
-	u32 i = 0;
+// Room for the rows and their lexer states, in one allocation
+static void block_rows(struct rblock* blk) {
+	blk->rows = malloc(BLOCK_ROWS * (sizeof(struct erow) + 1));
+	if (blk->rows == NULL) die("malloc");
+	blk->hl = (u8*)(blk->rows + BLOCK_ROWS);
+	memset(blk->hl, HL_UNKNOWN, BLOCK_ROWS);
+	E.row_blocks++;
+}
 
-	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return 1;
+static void block_free(struct rblock* blk) {
+	if (blk->rows) E.row_blocks--;
+	free(blk->matches);
+	free(blk->rows);
+	free(blk);
+}
 
-	while (i < sizeof(buf) - 1) {
-		if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
-		if (buf[i] == 'R') break;
-		i++;
+// Forget what's cached about block b. The one before it goes too, as a
+// multi-line match starting there may reach into b and a bulk delete may
+// have trimmed it.
+static void block_dirty(u32 b) {
+	E.match_ready = false;
+	for (u32 j = b ? b - 1 : 0; j <= b && j < E.block_count; j++) {
+		struct rblock* blk = E.blocks[j];
+		blk->bytes = UINT64_MAX;
+		blk->blank_count = UINT32_MAX;
+		free(blk->matches);
+		blk->matches = NULL;
+		blk->match_gen = blk->match_count = 0;
 	}
+}
 
-	buf[i] = '\0';
-	if (buf[0] != '\x1b' || buf[1] != '[') return 1;
-	if (sscanf(&buf[2], "%u;%u", row, col) != 2) return 1;
+static void block_remove(u32 b) {
+	block_free(E.blocks[b]);
+	memmove(&E.blocks[b], &E.blocks[b + 1], sizeof(*E.blocks) * (E.block_count - b - 1));
+	E.block_count--;
+	E.last_block = 0;
+	E.last_first = 0;
+}
 
-	return 0;
+// Get a block with its rows in place. The match workers call this as well,
+// hence the lock around splitting up a lazy block.
+static struct rblock* block_get(u32 b) {
+	struct rblock* blk = E.blocks[b];
+	if (__atomic_load_n(&blk->lazy, __ATOMIC_ACQUIRE) == NULL) return blk;
+
+	pthread_mutex_lock(&lazy_lock);
+	char* s = blk->lazy;
+	if (s != NULL) {
+		if (blk->rows == NULL) block_rows(blk);
+		for (u32 i = 0; i < blk->count; i++) {
+			char* eol = memchr(s, '\n', blk->lazy_end - s);
+			if (eol == NULL) eol = blk->lazy_end;
+
+			u32 len = eol - s;
+			while (len > 0 && s[len - 1] == '\r') len--;
+			blk->rows[i] = (struct erow){ .len = len, .cap = 0, .chars = s };
+			s = eol + 1;
+		}
+		__atomic_store_n(&blk->lazy, NULL, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&lazy_lock);
+	return blk;
 }
 
-static u8 get_winsize(u32* rows, u32* cols) {
-	struct winsize ws;
+// A lazy block without any \r in it is saved as is, so its size is known
+// without splitting it into rows
+static u64 block_bytes(u32 b) {
+	struct rblock* blk = E.blocks[b];
+	if (blk->bytes != UINT64_MAX) return blk->bytes;
 
-	if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
-		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return 1;
-		return get_cursor_pos(rows, cols);
+	u64 n = 0;
+	char* s = __atomic_load_n(&blk->lazy, __ATOMIC_ACQUIRE);
+	if (s && memchr(s, '\r', blk->lazy_end - s) == NULL) n = blk->lazy_end - s + (blk->lazy_end[-1] != '\n');
+	else {
+		blk = block_get(b);
+		for (u32 i = 0; i < blk->count; i++) n += blk->rows[i].len + 1;
 	}
+	return blk->bytes = n;
+}
 
-	*rows = ws.ws_row;
-	*cols = ws.ws_col;
-	return 0;
+static u64 buffer_bytes(void) {
+	u64 n = 0;
+	for (u32 b = 0; b < E.block_count; b++) n += block_bytes(b);
+	return n;
 }
 
-/*
- * File I/O
- */
-static void open_file(char* filepath) {
-	if (!filepath && !E.filename) {
-		statusmsg_set("No file name");
-		return;
-	} else if (filepath) {
-		free(E.filename);
-		E.filename = strdup(filepath);
-	} else filepath = E.filename;
+// Where row y starts in the file as it would be saved
+static u64 row_byte_offset(u32 y) {
+	if (y >= E.row_count) return buffer_bytes();
 
-	for (u32 i = 0; i < E.row_count; i++) row_free(&E.rows[i]);
-	free(E.rows);
-	E.rows = NULL;
-	E.row_count = 0;
+	u32 first;
+	u32 b = block_find(y, &first);
+	u64 n = 0;
+	for (u32 j = 0; j < b; j++) n += block_bytes(j);
 
-	E.cx = 0;
-	E.cy = 0;
+	struct rblock* blk = block_get(b);
+	for (u32 i = 0; i < y - first; i++) n += blk->rows[i].len + 1;
+	return n;
+}
 
-	FILE* fp = fopen(filepath, "r");
-	if (fp) {
-		char* row = NULL;
-		size_t row_cap = 0;
-		ssize_t row_len;
+// A lazy block can only have empty rows if it starts with one or has an
+// empty line or a \r in it somewhere, so most don't need splitting up
+static struct rblock* block_blanks(u32 b) {
+	struct rblock* blk = E.blocks[b];
+	if (blk->blank_count != UINT32_MAX) return blk;
+
+	memset(blk->blanks, 0, sizeof(blk->blanks));
+	blk->blank_count = 0;
+	char* s = __atomic_load_n(&blk->lazy, __ATOMIC_ACQUIRE);
+	u64 n = s ? blk->lazy_end - s : 0;
+	if (s && s[0] != '\n' && memmem(s, n, "\n\n", 2) == NULL && memchr(s, '\r', n) == NULL) return blk;
+
+	blk = block_get(b);
+	for (u32 i = 0; i < blk->count; i++) {
+		if (blk->rows[i].len != 0) continue;
+		blk->blanks[i / 64] |= 1ull << (i % 64);
+		blk->blank_count++;
+	}
+	return blk;
+}
 
-		while ((row_len = getline(&row, &row_cap, fp)) != -1) {
-			while (row_len > 0 && (row[row_len - 1] == '\n' || row[row_len - 1] == '\r')) row_len--;
-			row_insert(E.row_count, row, row_len);
+// First row at or after y that is empty (or isn't, for !blank), or
+// E.row_count if there's none
+static u32 blank_next(u32 y, bool blank) {
+	while (1) {
+		if (y >= E.row_count) index_wait(y);
+		if (y >= E.row_count) return E.row_count;
+
+		u32 first;
+		u32 b = block_find(y, &first);
+		struct rblock* blk = block_blanks(b);
+		if (blk->blank_count != (blank ? 0 : blk->count)) {
+			for (u32 i = y - first; i < blk->count; i = (i | 63) + 1) {
+				u64 w = blank ? blk->blanks[i / 64] : ~blk->blanks[i / 64];
+				w &= ~0ull << (i % 64);
+				if (w == 0) continue;
+				u32 r = (i & ~63u) + __builtin_ctzll(w);
+				if (r < blk->count) return first + r;
+				break;
+			}
 		}
-		free(row);
-		fclose(fp);
-	} else {
-		if (errno != ENOENT) statusmsg_set("Could not open %s", strerror(errno));
-		else statusmsg_set("New file");
+		y = first + blk->count;
 	}
+}
 
-	E.dirty = false;
+// Last row at or before y that is empty (or isn't), or UINT32_MAX
+static u32 blank_prev(u32 y, bool blank) {
+	if (y >= E.row_count) y = E.row_count - 1;
+	while (y != UINT32_MAX) {
+		u32 first;
+		u32 b = block_find(y, &first);
+		struct rblock* blk = block_blanks(b);
+		if (blk->blank_count != (blank ? 0 : blk->count)) {
+			for (u32 i = y - first; i != UINT32_MAX; i = (i & ~63u) - 1) {
+				u64 w = blank ? blk->blanks[i / 64] : ~blk->blanks[i / 64];
+				if (i % 64 != 63) w &= (1ull << (i % 64 + 1)) - 1;
+				if (w) return first + (i & ~63u) + 63 - __builtin_clzll(w);
+			}
+		}
+		y = first - 1;
+	}
+	return UINT32_MAX;
 }
 
-static void save_file(char* filepath) {
-	if (!E.filename && !filepath) {
-		statusmsg_set("No file name");
+static inline char* row_chars(struct erow* row) {
+	return row->cap == ROW_INLINE ? row->inl : row->chars;
+}
+
+static struct erow* row_at(u32 at) {
+	u32 first;
+	u32 b = block_find(at, &first);
+	return &block_get(b)->rows[at - first];
+}
+
+// Make sure the row owns room for 'len' bytes plus a terminator. A row gets
+// exactly what it needs at first, after that capacity grows geometrically
+// so a run of single byte inserts stays amortised O(1)
+static void row_reserve(struct erow* row, u32 len) {
+	if (row->cap != 0 && len < row->cap) return;
+
+	if (row->cap == 0 && len < ROW_INLINE) {
+		char* s = row->chars;
+		memcpy(row->inl, s, row->len);
+		row->inl[row->len] = '\0';
+		row->cap = ROW_INLINE;
 		return;
-	} else if (!E.filename) E.filename = strdup(filepath);
-	else if (!filepath) filepath = E.filename;
+	}
 
-	u32 len;
-	char* buf = rows_to_string(&len);
+	u32 cap = row->cap > ROW_INLINE ? row->cap * 2 : 0;
+	if (cap <= len) cap = (len + ARENA_ALIGN) & ~(ARENA_ALIGN - 1);
 
-	int fd = open(filepath, O_RDWR | O_CREAT | O_TRUNC, 0644);
-	if (
-		fd != -1 &&
-		ftruncate(fd, len) != -1 &&
-		write(fd, buf, len) == len &&
-		fsync(fd) != -1
-	   ) {
-		statusmsg_set("\"%s\" %uL, %uB written.", filepath, E.row_count, len);
-		E.dirty = false;
-	} else statusmsg_set("%s", strerror(errno));
+	char* chars = arena_alloc(cap);
+	memcpy(chars, row_chars(row), row->len);
+	chars[row->len] = '\0';
+	if (row->cap > ROW_INLINE) arena_free(row->chars, row->cap);
 
-	if (fd != -1) close(fd);
-	free(buf);
-	
+	row->chars = chars;
+	row->cap = cap;
 }
 
-/*
- * Rendering
- */
-static void draw_banner_row(struct abuf* ab, u32 y) {
-	if (y != E.screen_rows / 3) {
-		ab_append(ab, "~", 1);
-		return;
-	}
+static void row_own(struct erow* row) {
+	row_reserve(row, row->len);
+}
 
-	char msg[80];
-	u32 msg_len = snprintf(msg, sizeof(msg), "editor -- version %s", VERSION);
-	if (msg_len > E.screen_cols) msg_len = E.screen_cols;
-	u32 padding = (E.screen_cols - msg_len) / 2;
-	if (padding > 0) {
-		ab_append(ab, "~", 1);
-		padding--;
-	}
-	while (padding--) ab_append(ab, " ", 1);
-	ab_append(ab, msg, msg_len);
+static void row_free(struct erow *row) {
+	if (row->cap > ROW_INLINE) arena_free(row->chars, row->cap);
 }
 
-static void draw_file_row(struct abuf* ab, u32 file_row) {
-	u32 rlen = E.rows[file_row].rlen;
-	u32 len = (E.col_offset >= rlen) ? 0 : E.rows[file_row].rlen - E.col_offset;
+// Rows are neither visited nor freed one by one, their bytes all live in
+// the arena or the mapping
+static void rows_free(void) {
+	match_stop();
+	for (u32 b = 0; b < E.block_count; b++) block_free(E.blocks[b]);
+	arena_reset();
+	E.match_ready = false;
+	E.width_gen++;
+
+	free(E.blocks);
+	E.blocks = NULL;
+	E.block_count = E.block_cap = 0;
+	E.last_block = E.last_first = 0;
+	E.row_count = 0;
+	E.hl_lo = E.hl_hi = E.hl_top = 0;
+	E.hl_sync_lo = E.hl_sync_hi = 0;
+	damage_rows(0, UINT32_MAX);
+}
 
-	char linenr[6];
-	u32 linenr_len = snprintf(linenr, sizeof(linenr), "%4u ", file_row + 1);
+static struct erow* row_new(u32 at) {
+	if (at > E.row_count) at = E.row_count;
+	match_stop();
+
+	u32 b = 0, first = 0;
+	if (E.block_count == 0) block_rows(block_insert(0));
+	else b = block_find(at == E.row_count ? at - 1 : at, &first);
+
+	block_dirty(b);
+	E.width_gen++;
+	struct rblock* blk = block_get(b);
+	if (blk->count == BLOCK_ROWS) {
+		// Split a full block in half, unless we're appending to it (this
+		// keeps blocks packed when a file is read in line by line)
+		u32 keep = (at - first == BLOCK_ROWS) ? BLOCK_ROWS : BLOCK_ROWS / 2;
+		struct rblock* next = block_insert(b + 1);
+		block_rows(next);
+		memcpy(next->rows, &blk->rows[keep], sizeof(struct erow) * (BLOCK_ROWS - keep));
+		memcpy(next->hl, &blk->hl[keep], BLOCK_ROWS - keep);
+		next->count = BLOCK_ROWS - keep;
+		blk->count = keep;
+
+		if (at - first >= keep) {
+			first += keep;
+			blk = next;
+			b++;
+		}
+	}
 
-	if (len + linenr_len > E.screen_cols) len = E.screen_cols - linenr_len;
-	
-	ab_append(ab, linenr, linenr_len);
-	ab_append(ab, &E.rows[file_row].render[E.col_offset], len);
+	u32 i = at - first;
+	memmove(&blk->rows[i + 1], &blk->rows[i], sizeof(struct erow) * (blk->count - i));
+	memmove(&blk->hl[i + 1], &blk->hl[i], blk->count - i);
+	blk->hl[i] = HL_UNKNOWN;
+	blk->count++;
+	E.last_block = b;
+	E.last_first = first;
+
+	E.row_count++;
+	hl_edited(at, 1);
+	damage_rows(at, UINT32_MAX);
+	E.dirty = true;
+
+	return &blk->rows[i];
 }
 
-static void draw_rows(struct abuf* ab) {
-	for (u32 y = 0; y < E.screen_rows; y++) {
-		u32 file_row = y + E.row_offset;
-		if (E.row_count == 0) draw_banner_row(ab, y);
-		else if (file_row >= E.row_count) ab_append(ab, "~", 1);
-		else draw_file_row(ab, file_row);
+// 's' may be another row's inline bytes, which row_new() could move
+// along with their block, so short strings get copied out first
+static void row_insert(u32 at, char* s, u32 len) {
+	char tmp[ROW_INLINE];
+	if (len < ROW_INLINE) s = memcpy(tmp, s, len);
+	if (at > E.row_count) at = E.row_count;
+
+	struct erow* row = row_new(at);
+	*row = (struct erow){ .len = len, .cap = 0, .chars = s };
+	row_own(row);
+	undo_record(U_ROWS_INSERT, at, 0, s, len);
+	swap_log(U_ROWS_INSERT, at, 0, s, len);
+}
 
-		ab_append(ab, "\x1b[K", 3);
-		ab_append(ab, "\r\n", 2);
+// Insert the rows of s, joined by '\n', from 'at' on as one undo record.
+// Unlike row_insert(), s can't be row storage. Returns the rows inserted.
+static u32 row_insert_rows(u32 at, char* s, u32 len) {
+	if (at > E.row_count) at = E.row_count;
+	undo_record(U_ROWS_INSERT, at, 0, s, len);
+	swap_log(U_ROWS_INSERT, at, 0, s, len);
+
+	char* end = s + len;
+	for (u32 y = at; ; y++) {
+		char* nl = memchr(s, '\n', end - s);
+		if (nl == NULL) nl = end;
+		struct erow* row = row_new(y);
+		*row = (struct erow){ .len = nl - s, .cap = 0, .chars = s };
+		row_own(row);
+		if (nl == end) return y - at + 1;
+		s = nl + 1;
 	}
 }
 
-static void draw_statusbar(struct abuf* ab) {
-	ab_append(ab, "\x1b[7m", 4);
-	char lstatus[80], rstatus[80];
+static void row_insert_string(u32 y, u32 at, char* s, u32 len) {
+	match_stop();
+	struct erow* row = row_at(y);
+	block_dirty(E.last_block);
+	if (at > row->len) at = row->len;
+	width_edited(y, at);
+	undo_record(U_TEXT_INSERT, y, at, s, len);
+	swap_log(U_TEXT_INSERT, y, at, s, len);
+	row_reserve(row, row->len + len);
+	char* chars = row_chars(row);
+	memmove(&chars[at + len], &chars[at], row->len - at + 1);
+	memcpy(&chars[at], s, len);
+	row->len += len;
+	hl_edited(y, 0);
+	damage_rows(y, y + 1);
+	E.dirty = true;
+}
 
-	u32 llen = snprintf(lstatus, sizeof(lstatus), "%s %.20s %s", MODE_STR[E.mode], E.filename ? E.filename : "No file", E.dirty ? "[modified]" : "");
-	u32 rlen = snprintf(rstatus, sizeof(rstatus), "%u:%u", E.cx + 1, E.cy + 1);
+static void row_append_string(u32 y, char* s, u32 len) {
+	row_insert_string(y, UINT32_MAX, s, len);
+}
 
-	if (llen > E.screen_cols) llen = E.screen_cols;
-	ab_append(ab, lstatus, llen);
+static void row_insert_char(u32 y, u32 at, u32 c) {
+	char ch = c;
+	row_insert_string(y, at, &ch, 1);
+}
 
-	while (llen < E.screen_cols) {
-		if (E.screen_cols - llen == rlen) {
-			ab_append(ab, rstatus, rlen);
-			break;
+// Remove rows [at, at + n). Blocks that fall entirely inside the range are
+// dropped from the table in one go, only the two end blocks get shifted
+static void row_delete_rows(u32 at, u32 n) {
+	if (at >= E.row_count || n == 0) return;
+	if (n > E.row_count - at) n = E.row_count - at;
+	match_stop();
+	swap_log(U_ROWS_DELETE, at, 0, NULL, n);
+
+	for (u32 y = at; y < at + n; y++) {
+		struct erow* row = row_at(y);
+		if (y == at) undo_record(U_ROWS_DELETE, at, 0, row_chars(row), row->len);
+		else {
+			undo_extend("\n", 1);
+			undo_extend(row_chars(row), row->len);
 		}
+		row_free(row);
+	}
 
-		ab_append(ab, " ", 1);
-		llen++;
+	u32 first;
+	u32 b = block_find(at, &first);
+	struct rblock* blk = E.blocks[b];
+	u32 i = at - first;
+	u32 left = n;
+
+	u32 k = (left < blk->count - i) ? left : blk->count - i;
+	memmove(&blk->rows[i], &blk->rows[i + k], sizeof(struct erow) * (blk->count - i - k));
+	memmove(&blk->hl[i], &blk->hl[i + k], blk->count - i - k);
+	blk->count -= k;
+	left -= k;
+
+	// Drop the covered blocks (and the first one if it's now empty)
+	u32 lo = blk->count ? b + 1 : b, hi = b + 1;
+	while (left > 0 && left >= E.blocks[hi]->count) left -= E.blocks[hi++]->count;
+	for (u32 j = lo; j < hi; j++) block_free(E.blocks[j]);
+	memmove(&E.blocks[lo], &E.blocks[hi], sizeof(*E.blocks) * (E.block_count - hi));
+	E.block_count -= hi - lo;
+	E.last_block = 0;
+	E.last_first = 0;
+
+	if (left > 0) {
+		struct rblock* last = E.blocks[lo];
+		memmove(last->rows, &last->rows[left], sizeof(struct erow) * (last->count - left));
+		memmove(last->hl, &last->hl[left], last->count - left);
+		last->count -= left;
 	}
 
-	ab_append(ab, "\x1b[m", 3);
-	ab_append(ab, "\r\n", 2);
+	// Fold a mostly empty block into its successor so the table stays short
+	b = lo > 0 ? lo - 1 : 0;
+	for (u32 j = b; j <= b + 1 && j + 1 < E.block_count; j++) {
+		u32 count = E.blocks[j]->count, next_count = E.blocks[j + 1]->count;
+		if (count >= BLOCK_ROWS / 4 || count + next_count > BLOCK_ROWS) continue;
+
+		struct rblock* cur = block_get(j);
+		struct rblock* next = block_get(j + 1);
+		memcpy(&cur->rows[cur->count], next->rows, sizeof(struct erow) * next->count);
+		memcpy(&cur->hl[cur->count], next->hl, next->count);
+		cur->count += next->count;
+		block_remove(j + 1);
+		break;
+	}
+	if (lo < E.block_count) block_dirty(lo);
+	else if (lo > 0) block_dirty(lo - 1);
+	E.width_gen++;
+
+	E.row_count -= n;
+	hl_edited(at, -(i32)n);
+	damage_rows(at, UINT32_MAX);
+	E.dirty = true;
 }
 
-static void draw_statusmsg(struct abuf* ab) {
-	ab_append(ab, "\x1b[K", 3);
-	u32 msg_len = strlen(E.statusmsg);
-	if (msg_len > E.screen_cols) msg_len = E.screen_cols;
-	if (msg_len && time(NULL) - E.statusmsg_time < 5) ab_append(ab, E.statusmsg, msg_len);
+static void row_delete(u32 at) {
+	row_delete_rows(at, 1);
 }
 
-static void scroll(void) {
-	E.rx = E.cx;
-	E.ry = E.cy;
+static void row_delete_string(u32 y, u32 at, u32 len) {
+	struct erow* row = row_at(y);
+	if (at >= row->len) return;
+	match_stop();
+	block_dirty(E.last_block);
+	if (len > row->len - at) len = row->len - at;
+	width_edited(y, at);
+	undo_record(U_TEXT_DELETE, y, at, &row_chars(row)[at], len);
+	swap_log(U_TEXT_DELETE, y, at, NULL, len);
+	row_own(row);
+	char* chars = row_chars(row);
+	memmove(&chars[at], &chars[at + len], row->len - at - len + 1);
+	row->len -= len;
+	hl_edited(y, 0);
+	damage_rows(y, y + 1);
+	E.dirty = true;
+}
+
+static void row_truncate(u32 y, u32 len) {
+	struct erow* row = row_at(y);
+	if (len >= row->len) return;
+	match_stop();
+	block_dirty(E.last_block);
+	width_edited(y, len);
+	undo_record(U_TEXT_DELETE, y, len, &row_chars(row)[len], row->len - len);
+	swap_log(U_TEXT_DELETE, y, len, NULL, row->len - len);
+	row_own(row);
+	row->len = len;
+	row_chars(row)[len] = '\0';
+	hl_edited(y, 0);
+	damage_rows(y, y + 1);
+	E.dirty = true;
+}
+
+static char get_char_at(pos_t p) {
+	if (p.y >= E.row_count) return '\0';
+	struct erow* row = row_at(p.y);
+	if (p.x >= row->len) return '\n';
+	return row_chars(row)[p.x];
+}
+
+static void refresh_screen(void);
+static void handle_resize(void);
+static void index_poll(void);
+static void syntax_select(void);
+static void statusmsg_set(const char* fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+	va_end(ap);
+	E.statusmsg_time = time(NULL);
+	refresh_screen();
+}
+
+/*
+ * Undo journal
+ *
+ * Every row mutation appends a small record of what it changed, with the
+ * affected bytes kept in one growing text arena. Records are grouped into
+ * steps (one per normal mode command, including the INSERT session it
+ * starts), so undoing costs as much as the edit did, whatever the file size.
+ */
+
+// For U_ROWS_* the text holds the rows joined with '\n'
+struct urec { u8 op; u32 y, x, len, text; };
+
+static void undo_reset(void) {
+	free(E.urecs);
+	free(E.usteps);
+	ab_free(&E.utext);
+	E.urecs = NULL;
+	E.usteps = NULL;
+	E.urec_count = E.urec_cap = 0;
+	E.ustep_count = E.ustep_cap = 0;
+	E.ustep_pos = E.ustep_saved = 0;
+	E.ustep_open = false;
+}
+
+// End the current step, the next change starts a new one
+static void undo_commit(void) {
+	E.ustep_open = false;
+}
+
+static u32 step_end(u32 step) {
+	return step + 1 < E.ustep_count ? E.usteps[step + 1] : E.urec_count;
+}
+
+static void undo_record(u8 op, u32 y, u32 x, const char* s, u32 len) {
+	if (E.undoing) return;
+
+	if (E.ustep_pos < E.ustep_count) {
+		// A new change throws away whatever could have been redone
+		E.urec_count = E.usteps[E.ustep_pos];
+		E.utext.len = E.urecs[E.urec_count].text;
+		E.ustep_count = E.ustep_pos;
+		if (E.ustep_saved > E.ustep_pos) E.ustep_saved = UINT32_MAX;
+		E.ustep_open = false;
+	}
+
+	if (!E.ustep_open) {
+		if (E.ustep_count == E.ustep_cap) {
+			E.ustep_cap = E.ustep_cap ? E.ustep_cap * 2 : 64;
+			E.usteps = realloc(E.usteps, sizeof(*E.usteps) * E.ustep_cap);
+			if (E.usteps == NULL) die("realloc");
+		}
+		E.usteps[E.ustep_count++] = E.urec_count;
+		E.ustep_pos = E.ustep_count;
+		E.ustep_open = true;
+	}
+
+	// Typing, 'x' and backspacing extend the previous record of the step
+	struct urec* last = E.urec_count > E.usteps[E.ustep_count - 1] ? &E.urecs[E.urec_count - 1] : NULL;
+	if (last && last->op == op && last->y == y && op >= U_TEXT_INSERT) {
+		if ((op == U_TEXT_INSERT && x == last->x + last->len) || (op == U_TEXT_DELETE && x == last->x)) {
+			ab_append(&E.utext, s, len);
+			last->len += len;
+			return;
+		}
+		if (op == U_TEXT_DELETE && x + len == last->x) {
+			ab_reserve(&E.utext, len);
+			char* t = &E.utext.b[last->text];
+			memmove(t + len, t, last->len);
+			memcpy(t, s, len);
+			E.utext.len += len;
+			last->x = x;
+			last->len += len;
+			return;
+		}
+	}
+
+	if (E.urec_count == E.urec_cap) {
+		E.urec_cap = E.urec_cap ? E.urec_cap * 2 : 256;
+		E.urecs = realloc(E.urecs, sizeof(*E.urecs) * E.urec_cap);
+		if (E.urecs == NULL) die("realloc");
+	}
+	E.urecs[E.urec_count++] = (struct urec){ op, y, x, len, E.utext.len };
+	ab_append(&E.utext, s, len);
+}
+
+// Add more text to the record that was just made
+static void undo_extend(const char* s, u32 len) {
+	if (E.undoing) return;
+	ab_append(&E.utext, s, len);
+	E.urecs[E.urec_count - 1].len += len;
+}
+
+static void undo_apply(u8 op, struct urec* r) {
+	char* s = &E.utext.b[r->text];
+	char* end = s + r->len;
+
+	switch (op) {
+	case U_ROWS_INSERT: row_insert_rows(r->y, s, r->len); break;
+	case U_ROWS_DELETE: {
+		u32 n = 1;
+		while ((s = memchr(s, '\n', end - s)) != NULL) {
+			n++;
+			s++;
+		}
+		row_delete_rows(r->y, n);
+		break;
+	}
+	case U_TEXT_INSERT: row_insert_string(r->y, r->x, s, r->len); break;
+	case U_TEXT_DELETE: row_delete_string(r->y, r->x, r->len); break;
+	}
+}
+
+static void undo_step(bool redo) {
+	undo_commit();
+	if (redo ? E.ustep_pos == E.ustep_count : E.ustep_pos == 0) {
+		statusmsg_set(redo ? "Already at newest change" : "Already at oldest change");
+		return;
+	}
+
+	u32 step = redo ? E.ustep_pos++ : --E.ustep_pos;
+	u32 lo = E.usteps[step], hi = step_end(step);
+
+	E.undoing = true;
+	if (redo) for (u32 i = lo; i < hi; i++) undo_apply(E.urecs[i].op, &E.urecs[i]);
+	else for (u32 i = hi; i-- > lo; ) undo_apply(E.urecs[i].op ^ 1, &E.urecs[i]);
+	E.undoing = false;
+
+	E.cx = E.urecs[lo].x;
+	E.cy = E.urecs[lo].y;
+	E.dirty = E.ustep_pos != E.ustep_saved;
+}
+
+/*
+ * Registers
+ */
+static char* span_chars(struct reg* r, struct span* sp) {
+	return sp->mapped ? E.map + sp->off : r->own.b + sp->off;
+}
+
+static void reg_add(struct reg* r, char* s, u32 len, bool borrowed) {
+	if (r->count == r->cap) {
+		r->cap = r->cap ? r->cap * 2 : 16;
+		r->spans = realloc(r->spans, sizeof(*r->spans) * r->cap);
+		if (r->spans == NULL) die("realloc");
+	}
+
+	struct span* sp = &r->spans[r->count++];
+	sp->len = len;
+	sp->mapped = borrowed;
+	if (borrowed) sp->off = s - E.map;
+	else {
+		sp->off = r->own.len;
+		ab_append(&r->own, s, len);
+	}
+}
+
+// Fill the register with [start, end), or whole rows start.y..end.y
+static void reg_yank(struct reg* r, pos_t start, pos_t end, bool linewise) {
+	r->count = 0;
+	r->own.len = 0;
+	r->linewise = linewise;
+
+	for (u32 y = start.y; y <= end.y && y < E.row_count; y++) {
+		struct erow* row = row_at(y);
+		u32 lo = (linewise || y > start.y) ? 0 : start.x;
+		u32 hi = (linewise || y < end.y) ? row->len : end.x;
+		if (lo > row->len) lo = row->len;
+		if (hi > row->len) hi = row->len;
+		if (hi < lo) hi = lo;
+		reg_add(r, &row_chars(row)[lo], hi - lo, row->cap == 0);
+	}
+}
+
+// Copy out everything that still points into the mapping before it goes away
+static void reg_own(struct reg* r) {
+	for (u32 i = 0; i < r->count; i++) {
+		struct span* sp = &r->spans[i];
+		if (!sp->mapped) continue;
+		u64 off = r->own.len;
+		ab_append(&r->own, E.map + sp->off, sp->len);
+		sp->off = off;
+		sp->mapped = false;
+	}
+}
+
+static void reg_free(struct reg* r) {
+	free(r->spans);
+	ab_free(&r->own);
+	memset(r, 0, sizeof(*r));
+}
+
+/*
+ * Terminal functions
+ */
+static void disable_raw(void) {
+	write(STDOUT_FILENO, "\x1b[?2004l", 8);
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) die("tcsetattr");
+}
+
+static void enable_raw(void) {
+	if (tcgetattr(STDIN_FILENO, &E.orig_termios) == -1) die("tcgetattr");
+
+	struct termios raw = E.orig_termios;
+	raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+	raw.c_oflag &= ~(OPOST);
+	raw.c_cflag |= (CS8);
+	raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+	// Reads never block, all waiting is done in poll() by input_fill()
+	raw.c_cc[VMIN] = 0;
+	raw.c_cc[VTIME] = 0;
+
+	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+	// Have pastes bracketed by \x1b[200~ ... \x1b[201~
+	write(STDOUT_FILENO, "\x1b[?2004h", 8);
+}
+
+/*
+ * Input is read in bulk into a ring buffer, so a burst of keys (or a paste)
+ * costs a single syscall and an escape sequence split across reads is
+ * simply waited for instead of being mangled.
+ */
+static void sigwinch_handler(int sig) {
+	(void)sig;
+	int saved = errno;
+	write(E.wake_pipe[1], "w", 1);
+	errno = saved;
+}
+
+// How long we may sleep before something on screen has to change by itself
+static int timer_next(void) {
+	if (E.statusmsg[0] == '\0' || E.mode == M_COMMAND) return -1;
+
+	time_t left = E.statusmsg_time + MSG_TIMEOUT - time(NULL);
+	return (left > 0) ? left * 1000 : 0;
+}
+
+static void timer_run(void) {
+	if (E.statusmsg[0] == '\0' || E.mode == M_COMMAND) return;
+	if (time(NULL) - E.statusmsg_time < MSG_TIMEOUT) return;
+	E.statusmsg[0] = '\0';
+	refresh_screen();
+}
+
+// Sleep until input arrives, at most 'timeout' ms. A negative timeout waits
+// indefinitely, but wakes up for window resizes and timers in the meantime.
+static bool input_fill(int timeout) {
+	u32 used = E.in_tail - E.in_head;
+	if (used == INBUF_SIZE) return false;
+	swap_kick();
+
+	struct pollfd pfd[3] = {
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+		{ .fd = E.wake_pipe[0], .events = POLLIN },
+		{ .fd = E.watch, .events = POLLIN },
+	};
+
+	int ready = poll(pfd, 3, (timeout < 0) ? timer_next() : timeout);
+	if (ready == -1 && errno != EINTR) die("poll");
+
+	if (pfd[2].revents & POLLIN) {
+		follow_update();
+		refresh_screen();
+	}
+
+	if (pfd[1].revents & POLLIN) {
+		char buf[64];
+		bool resized = false, counted = false, indexed = false;
+		ssize_t n;
+		while ((n = read(E.wake_pipe[0], buf, sizeof(buf))) > 0) {
+			if (memchr(buf, 'w', n)) resized = true;
+			if (memchr(buf, 'm', n)) counted = true;
+			if (memchr(buf, 'l', n)) indexed = true;
+		}
+		if (indexed) index_poll();
+		if (resized) handle_resize();
+		else if (counted || indexed) refresh_screen();
+	}
+
+	if (ready == 0 && timeout < 0) timer_run();
+	if (ready <= 0 || !(pfd[0].revents & POLLIN)) return false;
+
+	u32 at = E.in_tail & (INBUF_SIZE - 1);
+	u32 room = INBUF_SIZE - used;
+	if (room > INBUF_SIZE - at) room = INBUF_SIZE - at;
+
+	ssize_t nread = read(STDIN_FILENO, &E.inbuf[at], room);
+	if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+	if (nread <= 0) return false;
+	E.in_tail += nread;
+	perf_input();
+	return true;
+}
+
+// Look at the i-th unread byte, waiting up to 'timeout' ms for it to arrive
+static bool input_peek(u32 i, char* c, int timeout) {
+	while (E.in_tail - E.in_head <= i) {
+		if (!input_fill(timeout)) return false;
+	}
+
+	*c = E.inbuf[(E.in_head + i) & (INBUF_SIZE - 1)];
+	return true;
+}
+
+static void input_consume(u32 n) {
+	E.in_head += n;
+}
+
+// Take out the unread byte at i, keeping the ones on either side of it
+static void input_drop(u32 i) {
+	for (; i != E.in_head; i--) E.inbuf[i & (INBUF_SIZE - 1)] = E.inbuf[(i - 1) & (INBUF_SIZE - 1)];
+	E.in_head++;
+}
+
+static bool input_pending(void) {
+	return E.in_tail != E.in_head || input_fill(0);
+}
+
+// xterm keys by the final byte of their CSI or SS3 sequence ("\x1b[A",
+// "\x1bOA", "\x1b[1;5A", ...). Modifiers are accepted but ignored.
+static const u16 final_keys[128] = {
+	['A'] = ARROW_UP, ['B'] = ARROW_DOWN, ['C'] = ARROW_RIGHT, ['D'] = ARROW_LEFT,
+	['F'] = END, ['H'] = HOME, ['Z'] = BACKTAB,
+	['P'] = F1, ['Q'] = F2, ['R'] = F3, ['S'] = F4,
+};
+
+// vt220 style "\x1b[<n>~" keys by their number
+static const u16 tilde_keys[] = {
+	[1] = HOME, [2] = INSERT, [3] = DELETE, [4] = END,
+	[5] = PAGE_UP, [6] = PAGE_DOWN, [7] = HOME, [8] = END,
+	[11] = F1, [12] = F2, [13] = F3, [14] = F4, [15] = F5,
+	[17] = F6, [18] = F7, [19] = F8, [20] = F9, [21] = F10,
+	[23] = F11, [24] = F12,
+	[200] = PASTE_BEGIN, [201] = PASTE_END,
+};
+
+// Decode the escape sequence at the head of the input. Returns 0 for a
+// complete sequence we don't know, which is dropped as a whole.
+static u32 decode_escape(u32* len) {
+	char c;
+	*len = 1;
+
+	// A lone ESC, or ESC followed by an ordinary key, is just ESC
+	if (!input_peek(1, &c, E.esc_timeout) || (c != '[' && c != 'O')) return ESCAPE;
+
+	u32 param = 0;
+	bool first = true;
+	for (u32 i = 2;; i++) {
+		if (!input_peek(i, &c, E.esc_timeout)) return ESCAPE;
+
+		if (c >= '0' && c <= '9') {
+			if (first && param < 1000) param = param * 10 + c - '0';
+		} else if (c == ';') {
+			first = false;
+		} else if (c >= 0x40 && c <= 0x7E) {
+			*len = i + 1;
+			break;
+		} else if (c < 0x20 || c > 0x3F) return ESCAPE;
+	}
+
+	if (c == '~') return (param < sizeof(tilde_keys) / sizeof(*tilde_keys)) ? tilde_keys[param] : 0;
+	return final_keys[(u8)c];
+}
+
+static u32 read_key(void) {
+	PERF_SCOPE(P_READ_KEY);
+	while (1) {
+		char c;
+		while (!input_peek(0, &c, -1));
+
+		if (c != ESCAPE) {
+			input_consume(1);
+			return (u8)c;
+		}
+
+		u32 len;
+		u32 key = decode_escape(&len);
+		input_consume(len);
+		if (key) return key;
+	}
+}
+
+static u8 get_cursor_pos(u32* row, u32* col) {
+	char buf[32];
+	u32 i = 0;
+
+	if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return 1;
+
+	while (i < sizeof(buf) - 1) {
+		if (!input_peek(0, &buf[i], 100)) break;
+		input_consume(1);
+		if (buf[i] == 'R') break;
+		i++;
+	}
+
+	buf[i] = '\0';
+	if (buf[0] != '\x1b' || buf[1] != '[') return 1;
+	if (sscanf(&buf[2], "%u;%u", row, col) != 2) return 1;
+
+	return 0;
+}
+
+static u8 get_winsize(u32* rows, u32* cols) {
+	struct winsize ws;
+
+	if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
+		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return 1;
+		return get_cursor_pos(rows, cols);
+	}
+
+	*rows = ws.ws_row;
+	*cols = ws.ws_col;
+	return 0;
+}
+
+/*
+ * File I/O
+ */
+/*
+ * Line index
+ *
+ * A mapped file is indexed by a background thread that counts newlines 16
+ * bytes at a time and notes where every BLOCK_ROWS-th line starts. Each of
+ * those checkpoints becomes a lazy block, so opening a file doesn't wait for
+ * the whole of it to be split into rows, and G just needs the line count.
+ */
+struct lindex {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t grew;
+	char* map;
+	u64 len;
+	u64* marks;		// Where lines 0, BLOCK_ROWS, 2 * BLOCK_ROWS, ... start
+	u32 mark_count, mark_cap;
+	u32 taken;		// Marks already turned into blocks
+	u64 lines, scanned;
+	bool done, cancel;
+	bool drop;		// Let go of the pages once they're scanned
+	int wake;
+};
+
+static void index_mark(u64** marks, u32* n, u32* cap, u64 off) {
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 64;
+		*marks = realloc(*marks, sizeof(**marks) * *cap);
+		if (*marks == NULL) die("realloc");
+	}
+	(*marks)[(*n)++] = off;
+}
+
+static u64 index_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Unmap the whole pages in [s, s + n) of the (read-only) file mapping. They
+// read back in from the page cache when touched again.
+static void pages_drop(const char* s, u64 n) {
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t lo = (uintptr_t)s & ~(page - 1);
+	uintptr_t hi = ((uintptr_t)s + n) & ~(page - 1);
+	if (hi > lo) madvise((void*)lo, hi - lo, MADV_DONTNEED);
+}
+
+static void* index_worker(void* arg) {
+	struct lindex* ix = arg;
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	const char* s = ix->map;
+	u64 lines = 0, at = 0, woke = 0;
+	u64* found = NULL;
+	u32 n = 0, cap = 0;
+
+	// Start small so the first screenful shows up right away
+	for (u64 chunk = INDEX_CHUNK / 16; at < ix->len; chunk = INDEX_CHUNK) {
+		u64 end = (ix->len - at > chunk) ? at + chunk : ix->len;
+		u64 i = at;
+#ifdef __SSE2__
+		const __m128i nl = _mm_set1_epi8('\n');
+		for (; i + 16 <= end; i += 16) {
+			u32 mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)&s[i]), nl));
+			u32 c = __builtin_popcount(mask);
+			if ((lines + c) / BLOCK_ROWS == lines / BLOCK_ROWS) {
+				lines += c;
+				continue;
+			}
+			for (; mask; mask &= mask - 1) {
+				if (++lines % BLOCK_ROWS == 0) index_mark(&found, &n, &cap, i + __builtin_ctz(mask) + 1);
+			}
+		}
+#endif
+		for (; i < end; i++) {
+			if (s[i] == '\n' && ++lines % BLOCK_ROWS == 0) index_mark(&found, &n, &cap, i + 1);
+		}
+		if (ix->drop) pages_drop(&s[at], end - at);
+		at = end;
+
+		pthread_mutex_lock(&ix->lock);
+		for (u32 j = 0; j < n; j++) {
+			if (found[j] < ix->len) index_mark(&ix->marks, &ix->mark_count, &ix->mark_cap, found[j]);
+		}
+		n = 0;
+		ix->lines = lines;
+		ix->scanned = at;
+		if (at == ix->len) {
+			if (s[ix->len - 1] != '\n') ix->lines++;
+			ix->done = true;
+		}
+		bool cancel = ix->cancel;
+		pthread_cond_broadcast(&ix->grew);
+		pthread_mutex_unlock(&ix->lock);
+		if (cancel) break;
+
+		u64 now = index_now();
+		if (woke == 0 || now - woke >= INDEX_WAKE || at == ix->len) {
+			write(ix->wake, "l", 1);
+			woke = now;
+		}
+	}
+
+	free(found);
+	return NULL;
+}
+
+static void index_start(char* map, u64 len) {
+	struct lindex* ix = calloc(1, sizeof(*ix));
+	if (ix == NULL) die("calloc");
+	pthread_mutex_init(&ix->lock, NULL);
+	pthread_cond_init(&ix->grew, NULL);
+	ix->map = map;
+	ix->len = len;
+	ix->wake = E.wake_pipe[1];
+	ix->drop = E.view;
+	index_mark(&ix->marks, &ix->mark_count, &ix->mark_cap, 0);
+
+	if (pthread_create(&ix->thread, NULL, index_worker, ix) != 0) die("pthread_create");
+	E.index = ix;
+}
+
+static void index_free(struct lindex* ix) {
+	pthread_mutex_destroy(&ix->lock);
+	pthread_cond_destroy(&ix->grew);
+	free(ix->marks);
+	free(ix);
+}
+
+static void index_stop(void) {
+	if (E.index == NULL) return;
+	pthread_mutex_lock(&E.index->lock);
+	E.index->cancel = true;
+	pthread_mutex_unlock(&E.index->lock);
+	pthread_join(E.index->thread, NULL);
+	index_free(E.index);
+	E.index = NULL;
+}
+
+// Turn the checkpoints found so far into blocks at the end of the buffer,
+// returns whether the indexer is done
+static bool index_take(struct lindex* ix) {
+	pthread_mutex_lock(&ix->lock);
+	bool done = ix->done;
+	// A block is complete once the next one has started
+	u32 avail = done ? ix->mark_count : ix->mark_count - 1;
+	if (ix->taken < avail) {
+		match_stop();
+		E.match_ready = false;
+		damage_rows(E.row_count, UINT32_MAX);
+	}
+	for (; ix->taken < avail; ix->taken++) {
+		u32 j = ix->taken;
+		struct rblock* blk = block_insert(E.block_count);
+		bool last = j + 1 == ix->mark_count;
+		blk->count = last ? ix->lines - (u64)j * BLOCK_ROWS : BLOCK_ROWS;
+		blk->lazy = ix->map + ix->marks[j];
+		blk->lazy_end = ix->map + (last ? ix->len : ix->marks[j + 1]);
+		E.row_count += blk->count;
+	}
+	pthread_mutex_unlock(&ix->lock);
+	return done;
+}
+
+static void index_poll(void) {
+	struct lindex* ix = E.index;
+	if (ix && index_take(ix)) {
+		pthread_join(ix->thread, NULL);
+		index_free(ix);
+		E.index = NULL;
+		follow_update();
+	}
+}
+
+// Stop loading and keep the lines that have been counted so far
+static void index_cancel(void) {
+	struct lindex* ix = E.index;
+	pthread_mutex_lock(&ix->lock);
+	ix->cancel = true;
+	pthread_mutex_unlock(&ix->lock);
+	pthread_join(ix->thread, NULL);
+
+	if (!index_take(ix)) {
+		// The last block ends at the last newline that was seen
+		u32 j = ix->mark_count - 1;
+		u32 count = ix->lines - (u64)j * BLOCK_ROWS;
+		char* start = ix->map + ix->marks[j];
+		char* eol = memrchr(start, '\n', ix->scanned - ix->marks[j]);
+		if (count > 0 && eol != NULL) {
+			struct rblock* blk = block_insert(E.block_count);
+			blk->count = count;
+			blk->lazy = start;
+			blk->lazy_end = eol + 1;
+			E.row_count += count;
+		}
+		E.partial = true;
+	}
+
+	index_free(ix);
+	E.index = NULL;
+	if (E.partial) statusmsg_set("Loading stopped, %u lines read", E.row_count);
+}
+
+// Percent of the file indexed so far
+static u32 index_progress(void) {
+	struct lindex* ix = E.index;
+	pthread_mutex_lock(&ix->lock);
+	u32 pct = ix->scanned * 100 / ix->len;
+	pthread_mutex_unlock(&ix->lock);
+	return pct;
+}
+
+// Wait until row 'y' exists or the whole file is in. Keys typed meanwhile
+// are kept for later, except for ESC or ^C typed ahead of any of them, which
+// stop the loading. An ESC after other keys ends what they started instead.
+static void index_wait(u32 y) {
+	while (E.index && E.row_count <= y) {
+		if (E.in_tail - E.in_head == INBUF_SIZE) {
+			struct lindex* ix = E.index;
+			pthread_mutex_lock(&ix->lock);
+			if (!ix->done && ix->mark_count <= ix->taken + 1) pthread_cond_wait(&ix->grew, &ix->lock);
+			pthread_mutex_unlock(&ix->lock);
+			index_poll();
+			continue;
+		}
+
+		if (!input_fill(INDEX_WAKE)) {
+			index_poll();
+			continue;
+		}
+
+		char c = E.inbuf[E.in_head & (INBUF_SIZE - 1)];
+		char next = (E.in_head + 1 != E.in_tail) ? E.inbuf[(E.in_head + 1) & (INBUF_SIZE - 1)] : '\0';
+		if (c == CTRL_KEY('c') || (c == ESCAPE && next != '[' && next != 'O')) {
+			input_consume(1);
+			index_cancel();
+			return;
+		}
+	}
+}
+
+static bool file_stamp(const char* path, struct fstamp* fs) {
+	struct stat st;
+	memset(fs, 0, sizeof(*fs));
+	if (stat(path, &st) == -1) return false;
+	fs->dev = st.st_dev;
+	fs->ino = st.st_ino;
+	fs->size = st.st_size;
+	fs->mtime = st.st_mtim;
+	return true;
+}
+
+static bool stamp_equal(const struct fstamp* a, const struct fstamp* b) {
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+		a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+// Have inotify tell us when the file changes, see follow_update()
+static void follow_watch(void) {
+	if (E.watch != -1) close(E.watch);
+	E.watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	u32 mask = IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF;
+	if (E.watch != -1 && inotify_add_watch(E.watch, E.filename, mask) != -1) return;
+
+	statusmsg_set("Can't follow %s: %s", E.filename, strerror(errno));
+	if (E.watch != -1) close(E.watch);
+	E.watch = -1;
+	E.follow = false;
+}
+
+static bool map_file(char* filepath) {
+	int fd = open(filepath, O_RDONLY);
+	if (fd == -1) return false;
+
+	// A read-only buffer maps room for the file to grow, and takes it even
+	// when empty, so there's something to follow
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || (st.st_size == 0 && !E.view)) {
+		close(fd);
+		return false;
+	}
+
+	u64 size = E.view ? st.st_size + VIEW_RESERVE : (u64)st.st_size;
+	char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return false;
+
+	E.map = map;
+	E.map_len = st.st_size;
+	E.map_size = size;
+	if (E.map_len) index_start(map, E.map_len);
+	if (E.follow) follow_watch();
+	return true;
+}
+
+static void map_close(void) {
+	index_stop();
+	if (E.watch != -1) close(E.watch);
+	E.watch = -1;
+	if (!E.map) return;
+	reg_own(&E.reg);
+	munmap(E.map, E.map_size);
+	E.map = NULL;
+	E.map_len = E.map_size = 0;
+}
+
+static void open_file(char* filepath) {
+	PERF_SCOPE(P_OPEN);
+	if (!filepath && !E.filename) {
+		statusmsg_set("No file name");
+		return;
+	}
+
+	swap_remove();
+	if (filepath) {
+		free(E.filename);
+		E.filename = strdup(filepath);
+	} else filepath = E.filename;
+
+	rows_free();
+	syntax_select();
+	map_close();
+
+	E.cx = 0;
+	E.cy = 0;
+	E.partial = false;
+	E.noswap = true;
+	file_stamp(filepath, &E.stamp);
+
+	// Regular files are mapped and their rows borrow from the mapping;
+	// anything we can't map (pipes, empty files, ...) is read line by line
+	FILE* fp = NULL;
+	if (map_file(filepath)) index_wait(E.screen_rows);
+	else if ((fp = fopen(filepath, "r")) == NULL) {
+		if (errno != ENOENT) statusmsg_set("Could not open %s", strerror(errno));
+		else statusmsg_set("New file");
+	} else {
+		char* row = NULL;
+		size_t row_cap = 0;
+		ssize_t row_len;
+
+		while ((row_len = getline(&row, &row_cap, fp)) != -1) {
+			while (row_len > 0 && (row[row_len - 1] == '\n' || row[row_len - 1] == '\r')) row_len--;
+			row_insert(E.row_count, row, row_len);
+		}
+		free(row);
+		fclose(fp);
+	}
+
+	undo_reset();
+	E.dirty = false;
+	swap_recover();
+}
+
+static bool writev_all(int fd, struct iovec* iov, u32 n, u64* total) {
+	while (n > 0) {
+		ssize_t written = writev(fd, iov, n);
+		if (written == -1) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		*total += written;
+
+		// Skip what went out and resume partway into the first short iovec
+		while (n > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return true;
+}
+
+// Stream the rows straight from their storage, a batch of lines per writev()
+static bool write_rows(int fd, u64* total) {
+	struct iovec iov[SAVE_IOVS];
+	u32 n = 0;
+	*total = 0;
+
+	for (u32 b = 0; b < E.block_count; b++) {
+		struct rblock* blk = E.blocks[b];
+
+		// Untouched lines of the mapping go out as they are, as long as
+		// they don't have \r\n endings that would be rewritten
+		if (blk->lazy && memchr(blk->lazy, '\r', blk->lazy_end - blk->lazy) == NULL) {
+			iov[n++] = (struct iovec){ blk->lazy, blk->lazy_end - blk->lazy };
+			if (blk->lazy_end[-1] != '\n') iov[n++] = (struct iovec){ "\n", 1 };
+			if (n >= SAVE_IOVS - 1) {
+				if (!writev_all(fd, iov, n, total)) return false;
+				n = 0;
+			}
+			continue;
+		}
+
+		blk = block_get(b);
+		for (u32 i = 0; i < blk->count; i++) {
+			iov[n++] = (struct iovec){ row_chars(&blk->rows[i]), blk->rows[i].len };
+			iov[n++] = (struct iovec){ "\n", 1 };
+			if (n >= SAVE_IOVS - 1) {
+				if (!writev_all(fd, iov, n, total)) return false;
+				n = 0;
+			}
+		}
+	}
+
+	return writev_all(fd, iov, n, total);
+}
+
+// The buffer is written to a temporary file next to the target, which is
+// then renamed over it. A crash or a full disk halfway through leaves the
+// old file intact, and rows still borrowing from the old file's mapping
+// stay valid since the mapped inode lives on until we unmap it.
+static bool save_file(char* filepath, bool force) {
+	PERF_SCOPE(P_SAVE);
+	if (!E.filename && !filepath) {
+		statusmsg_set("No file name");
+		return false;
+	} else if (!E.filename) {
+		E.filename = strdup(filepath);
+		syntax_select();
+	} else if (!filepath) filepath = E.filename;
+
+	if (E.view && !force) {
+		statusmsg_set("Buffer is read-only (add ! to override)");
+		return false;
+	}
+
+	index_wait(UINT32_MAX);
+	if (E.partial && !force) {
+		statusmsg_set("File is only partly loaded (add ! to override)");
+		return false;
+	}
+
+	// Write through symlinks rather than replacing them
+	char* target = realpath(filepath, NULL);
+	char* path = target ? target : filepath;
+
+	char* slash = strrchr(path, '/');
+	int dirlen = slash ? slash - path + 1 : 0;
+	char* tmp = malloc(strlen(path) + 16);
+	if (tmp == NULL) die("malloc");
+	sprintf(tmp, "%.*s.%s.XXXXXX", dirlen, path, path + dirlen);
+
+	struct stat st;
+	bool exists = stat(path, &st) == 0;
+	if (!exists) {
+		mode_t mask = umask(0);
+		umask(mask);
+		st.st_mode = 0644 & ~mask;
+	}
+
+	u64 len = 0;
+	int fd = mkstemp(tmp);
+
+	// Best effort, only matters when editing someone else's file as root
+	if (fd != -1 && exists && fchown(fd, st.st_uid, st.st_gid) == -1) errno = 0;
+
+	bool ok =
+		fd != -1 &&
+		fchmod(fd, st.st_mode & 07777) != -1 &&
+		write_rows(fd, &len) &&
+		fsync(fd) != -1;
+	int err = errno;
+
+	if (fd != -1) {
+		if (close(fd) == -1 && ok) {
+			ok = false;
+			err = errno;
+		}
+		if (ok && rename(tmp, path) == -1) {
+			ok = false;
+			err = errno;
+		}
+		if (!ok) unlink(tmp);
+	}
+
+	if (ok) {
+		undo_commit();
+		E.ustep_saved = E.ustep_pos;
+		E.dirty = false;
+		if (strcmp(filepath, E.filename) == 0) {
+			swap_remove();
+			file_stamp(E.filename, &E.stamp);
+			// A view's mapping and watch are still on the old file
+			if (E.view) buffer_reload();
+		}
+		statusmsg_set("\"%s\" %uL, %" PRIu64 "B written.", filepath, E.row_count, len);
+	} else statusmsg_set("%s", strerror(err));
+
+	free(tmp);
+	free(target);
+	return ok;
+}
+
+static void file_info(void) {
+	index_wait(UINT32_MAX);
+	u64 size = buffer_bytes();
+	u64 at = row_byte_offset(E.cy);
+	if (E.cy < E.row_count) at += E.cx;
+
+	statusmsg_set("\"%s\"%s %uL, %" PRIu64 "B, byte %" PRIu64 " (%u%%)", E.filename ? E.filename : "No file",
+		E.dirty ? " [modified]" : "", E.row_count, size, at, size ? (u32)(at * 100 / size) : 0);
+}
+
+/*
+ * Swap file
+ *
+ * Every change to a named buffer is also logged to .NAME.swp next to its
+ * file, so a crash only loses what hadn't reached the disk yet. A record is
+ * an undo record without its text offset, followed by the inserted bytes
+ * (rows joined by '\n', as in the journal); deletes only need their length,
+ * or for a row delete the number of rows.
+ * The file starts with the stamp of the file the changes apply to, and
+ * opening that same file again replays them. The main thread only appends
+ * to a buffer, the writer thread does the write() and fdatasync(), taking
+ * whatever piled up meanwhile as the next batch.
+ */
+#define SWAP_MAGIC	"edswp01\n"
+
+struct swap_head { char magic[8]; struct fstamp stamp; };
+struct swap_rec { u8 op; u32 y, x, len; } __attribute__((packed));
+
+static struct {
+	pthread_t thread;
+	bool started;
+	pthread_mutex_t lock;
+	pthread_cond_t wake, idle;
+	struct abuf out;	// Logged on the main thread for out_fd
+	int out_fd;
+	struct abuf queue;	// Handed over to the writer for fd
+	int fd;
+	int busy;		// The fd being written, or -1
+	int error;
+} J = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+	.out_fd = -1,
+	.fd = -1,
+	.busy = -1,
+};
+
+static void* swap_writer(void* arg) {
+	(void)arg;
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	struct abuf batch = { 0 };
+	pthread_mutex_lock(&J.lock);
+	while (1) {
+		while (J.queue.len == 0) pthread_cond_wait(&J.wake, &J.lock);
+		struct abuf t = batch;
+		batch = J.queue;
+		J.queue = t;
+		int fd = J.busy = J.fd;
+		pthread_mutex_unlock(&J.lock);
+
+		struct iovec iov = { batch.b, batch.len };
+		u64 written;
+		int err = (writev_all(fd, &iov, 1, &written) && fdatasync(fd) != -1) ? 0 : errno;
+		batch.len = 0;
+
+		pthread_mutex_lock(&J.lock);
+		if (err) J.error = err;
+		J.busy = -1;
+		pthread_cond_broadcast(&J.idle);
+	}
+	return NULL;
+}
+
+// Give the writer what's been logged, before we sit waiting for input
+static void swap_kick(void) {
+	if (J.out.len == 0) return;
+	if (!J.started) {
+		if (pthread_create(&J.thread, NULL, swap_writer, NULL) != 0) die("pthread_create");
+		J.started = true;
+	}
+
+	pthread_mutex_lock(&J.lock);
+	while (J.queue.len > 0 && J.fd != J.out_fd) pthread_cond_wait(&J.idle, &J.lock);
+	if (J.queue.len == 0) {
+		struct abuf t = J.queue;
+		J.queue = J.out;
+		J.out = t;
+	} else {
+		ab_append(&J.queue, J.out.b, J.out.len);
+		J.out.len = 0;
+	}
+	J.fd = J.out_fd;
+	int err = J.error;
+	J.error = 0;
+	pthread_cond_signal(&J.wake);
+	pthread_mutex_unlock(&J.lock);
+
+	if (err) statusmsg_set("Can't write the swap file: %s", strerror(err));
+}
+
+static char* swap_path(void) {
+	char* target = realpath(E.filename, NULL);
+	char* path = target ? target : E.filename;
+	char* slash = strrchr(path, '/');
+	int dirlen = slash ? slash - path + 1 : 0;
+	char* swp = malloc(strlen(path) + 6);
+	if (swp == NULL) die("malloc");
+	sprintf(swp, "%.*s.%s.swp", dirlen, path, path + dirlen);
+	free(target);
+	return swp;
+}
+
+// Open the swap file and keep others off it. Another editor holding it is
+// taken as it being in use, and the buffer goes without one.
+static int swap_lock(const char* path, int flags) {
+	int fd = open(path, O_RDWR | O_CLOEXEC | flags, 0600);
+	if (fd == -1 || flock(fd, LOCK_EX | LOCK_NB) == 0) return fd;
+	int err = errno;
+
+	if (err == EWOULDBLOCK) statusmsg_set("%s is in use, changes won't be backed up", path);
+	else statusmsg_set("Can't lock %s: %s", path, strerror(err));
+	close(fd);
+	E.noswap = true;
+	return -1;
+}
+
+// Log to fd from here on, starting with a header for the file as it is
+static void swap_start(int fd) {
+	swap_kick();
+	J.out_fd = E.swap = fd;
+	struct swap_head h = { .stamp = E.stamp };
+	memcpy(h.magic, SWAP_MAGIC, sizeof(h.magic));
+	ab_append(&J.out, (char*)&h, sizeof(h));
+}
+
+// Start the buffer's swap file with its first change
+static bool swap_open(void) {
+	if (E.noswap || E.view || E.filename == NULL) return false;
+
+	char* path = swap_path();
+	int fd = swap_lock(path, O_CREAT);
+	if (fd != -1 && ftruncate(fd, 0) == -1) {
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1 && !E.noswap) statusmsg_set("Can't create %s: %s", path, strerror(errno));
+	free(path);
+	if (fd == -1) {
+		E.noswap = true;
+		return false;
+	}
+
+	swap_start(fd);
+	return true;
+}
+
+static void swap_log(u8 op, u32 y, u32 x, const char* s, u32 len) {
+	if (E.swap == -1 && !swap_open()) return;
+	if (J.out_fd != E.swap) {
+		swap_kick();
+		J.out_fd = E.swap;
+	}
+
+	struct swap_rec r = { op, y, x, len };
+	ab_append(&J.out, (char*)&r, sizeof(r));
+	if (s) ab_append(&J.out, s, len);
+}
+
+// The buffer's changes are on disk (or thrown away), so its swap file goes.
+// One left behind by die() is what gets recovered.
+static void swap_remove(void) {
+	if (E.swap == -1 || E.dying) return;
+
+	if (J.out_fd == E.swap) J.out.len = 0;
+	pthread_mutex_lock(&J.lock);
+	if (J.fd == E.swap) J.queue.len = 0;
+	while (J.busy == E.swap) pthread_cond_wait(&J.idle, &J.lock);
+	pthread_mutex_unlock(&J.lock);
+
+	char* path = swap_path();
+	unlink(path);
+	free(path);
+	close(E.swap);
+	E.swap = -1;
+}
+
+static bool swap_apply(struct swap_rec* r, char* s) {
+	switch (r->op) {
+	case U_ROWS_INSERT:
+		if (r->y > E.row_count) return false;
+		row_insert_rows(r->y, s, r->len);
+		return true;
+	case U_ROWS_DELETE:
+		if (r->y >= E.row_count) return false;
+		row_delete_rows(r->y, r->len);
+		return true;
+	case U_TEXT_INSERT:
+		if (r->y >= E.row_count) return false;
+		row_insert_string(r->y, r->x, s, r->len);
+		return true;
+	case U_TEXT_DELETE:
+		if (r->y >= E.row_count) return false;
+		row_delete_string(r->y, r->x, r->len);
+		return true;
+	}
+	return false;
+}
+
+// Replay what a crashed session left in the swap file, up to the last
+// whole record. The replayed changes make up one undo step, and the file
+// stays on as this buffer's swap file.
+static void swap_recover(void) {
+	E.noswap = false;
+	if (E.view || E.filename == NULL) return;
+
+	char* path = swap_path();
+	int fd = swap_lock(path, 0);
+	struct stat st;
+	struct swap_head h;
+	char* map = MAP_FAILED;
+	if (fd == -1 || fstat(fd, &st) == -1 || (u64)st.st_size < sizeof(h) ||
+		(map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) goto out;
+
+	memcpy(&h, map, sizeof(h));
+	if (memcmp(h.magic, SWAP_MAGIC, sizeof(h.magic)) != 0) goto out;
+	bool stale = !stamp_equal(&h.stamp, &E.stamp);
+	if (stale && (u64)st.st_size > sizeof(h)) {
+		statusmsg_set("%s is for another version of the file, not recovered", path);
+		E.noswap = true;
+		goto out;
+	}
+
+	index_wait(UINT32_MAX);
+	if (E.partial) {
+		statusmsg_set("File is only partly loaded, %s not recovered", path);
+		E.noswap = true;
+		goto out;
+	}
+
+	u64 at = sizeof(h), size = st.st_size;
+	u32 n = 0;
+	E.noswap = true;
+	while (at + sizeof(struct swap_rec) <= size) {
+		struct swap_rec r;
+		memcpy(&r, map + at, sizeof(r));
+		bool text = r.op == U_ROWS_INSERT || r.op == U_TEXT_INSERT;
+		u64 next = at + sizeof(r) + (text ? r.len : 0);
+		if (next > size || !swap_apply(&r, text ? map + at + sizeof(r) : NULL)) break;
+		at = next;
+		n++;
+	}
+	E.noswap = false;
+	undo_commit();
+
+	// Carry on from the last whole record, or start over if there's only
+	// a header and that's for another version of the file
+	if (stale) at = 0;
+	if (ftruncate(fd, at) == -1 || lseek(fd, at, SEEK_SET) == -1) goto out;
+	if (n > 0) statusmsg_set("Recovered %u change%s from %s", n, n == 1 ? "" : "s", path);
+	if (stale) swap_start(fd);
+	else E.swap = fd;
+	fd = -1;
+
+out:
+	if (map != MAP_FAILED) munmap(map, st.st_size);
+	if (fd != -1) close(fd);
+	free(path);
+}
+
+/*
+ * Read-only view
+ *
+ * A buffer opened with -R or :view can't be changed, so its rows always
+ * borrow from the mapping the way the line indexer found them. Only about
+ * VIEW_BLOCKS blocks around the screen are kept split into rows, the rest
+ * go back to being lazy and the pages they were read from are dropped. That
+ * keeps memory flat however big the file gets, bar the block headers and
+ * the line index (some 100 bytes per BLOCK_ROWS lines).
+ *
+ * With follow on, inotify says when the file changes and only what was
+ * appended gets split into rows. The mapping has VIEW_RESERVE bytes to
+ * spare past the end of the file, so it can grow without being moved.
+ */
+
+// Put blocks far from the screen back to being lazy. Called where nothing
+// holds on to a row.
+static void view_trim(void) {
+	if (!E.view || !E.map || E.row_blocks <= VIEW_BLOCKS) return;
+	match_stop();
+
+	u32 first;
+	u32 lo = block_find(E.row_offset, &first);
+	u32 hi = block_find(E.cy, &first);
+	if (lo > hi) {
+		u32 t = lo;
+		lo = hi;
+		hi = t;
+	}
+	lo = (lo > VIEW_BLOCKS / 4) ? lo - VIEW_BLOCKS / 4 : 0;
+	hi += VIEW_BLOCKS / 4;
+
+	first = 0;
+	for (u32 b = 0; b < E.block_count; first += E.blocks[b++]->count) {
+		struct rblock* blk = E.blocks[b];
+		if ((b >= lo && b <= hi) || blk->rows == NULL || blk->lazy != NULL || blk->count == 0) continue;
+
+		char* s = blk->rows[0].chars;
+		free(blk->rows);
+		blk->rows = NULL;
+		blk->hl = NULL;
+		E.row_blocks--;
+		__atomic_store_n(&blk->lazy, s, __ATOMIC_RELEASE);
+		pages_drop(s, blk->lazy_end - s);
+
+		// The lexer states went with the rows
+		if (E.hl_lo > first) E.hl_lo = first;
+		if (E.hl_top > first) E.hl_top = first;
+		if (E.hl_sync_hi > first && E.hl_sync_lo < first + blk->count) E.hl_sync_lo = E.hl_sync_hi = 0;
+	}
+}
+
+// Pick up what was appended to a followed file. If it was replaced or cut
+// short instead, it's read in from scratch.
+static void follow_update(void) {
+	if (!E.follow || E.index || E.partial) return;
+
+	char buf[4096];
+	while (read(E.watch, buf, sizeof(buf)) > 0);
+
+	struct fstamp now;
+	if (!file_stamp(E.filename, &now) || stamp_equal(&now, &E.stamp)) return;
+
+	u64 len = now.size;
+	if (now.dev != E.stamp.dev || now.ino != E.stamp.ino || len < E.map_len || len > E.map_size) {
+		open_file(NULL);
+		index_wait(UINT32_MAX);
+		E.cy = E.row_count - (E.row_count > 0);
+		return;
+	}
+	E.stamp = now;
+	if (len == E.map_len) return;
+
+	match_stop();
+	bool tail = E.cy + 1 >= E.row_count;
+	u32 from = E.row_count;
+	char* s = E.map + E.map_len;
+
+	// An unterminated last line is read again along with what follows it
+	if (E.block_count > 0) {
+		u32 b = E.block_count - 1;
+		struct rblock* blk = block_get(b);
+		if (E.map_len > 0 && E.map[E.map_len - 1] != '\n' && blk->count > 0) {
+			s = blk->rows[--blk->count].chars;
+			blk->lazy_end = s;
+			E.row_count--;
+			from--;
+		}
+		block_dirty(b);
+		E.width_gen++;
+	}
+	E.map_len = len;
+
+	// Top up the last block before starting new ones
+	char* end = E.map + len;
+	while (s < end) {
+		struct rblock* blk = E.block_count ? E.blocks[E.block_count - 1] : NULL;
+		if (blk == NULL || blk->count == BLOCK_ROWS) {
+			blk = block_insert(E.block_count);
+			blk->lazy = blk->lazy_end = s;
+		}
+
+		for (; blk->count < BLOCK_ROWS && s < end; blk->count++, E.row_count++) {
+			char* eol = memchr(s, '\n', end - s);
+			char* next = eol ? eol + 1 : end;
+			if (blk->lazy == NULL) {
+				u32 n = (eol ? eol : end) - s;
+				while (n > 0 && s[n - 1] == '\r') n--;
+				blk->rows[blk->count] = (struct erow){ .len = n, .cap = 0, .chars = s };
+				blk->hl[blk->count] = HL_UNKNOWN;
+			}
+			s = next;
+		}
+		blk->lazy_end = s;
+	}
+
+	hl_edited(from, 0);
+	damage_rows(from, UINT32_MAX);
+	if (tail) E.cy = E.row_count - (E.row_count > 0);
+}
+
+/*
+ * Buffer list
+ *
+ * The buffer being edited lives in E, the others are parked in B.list with
+ * their rows, mapping, undo history and line arena, so switching back to
+ * one is a matter of swapping its state back in. Its slot in the list sits
+ * empty while it's current. Once the parked buffers take up more than
+ * BUFFER_MEMORY, the least recently used unmodified ones are dropped down
+ * to just their name and cursor and get read in again when next shown.
+ */
+struct buffer {
+	u32 id;
+	u64 used;
+	bool loaded;
+	u32 cx, cy;
+	u32 row_offset, col_offset;
+	u32 row_count;
+	struct rblock** blocks;
+	u32 block_count, block_cap;
+	u32 last_block, last_first;
+	bool dirty;
+	char* filename;
+	struct fstamp stamp;
+	char* map;
+	u64 map_len, map_size;
+	bool view, follow;
+	int watch;
+	u32 row_blocks;
+	int swap;
+	bool noswap;
+	struct urec* urecs;
+	u32 urec_count, urec_cap;
+	u32* usteps;
+	u32 ustep_count, ustep_cap;
+	u32 ustep_pos, ustep_saved;
+	bool ustep_open;
+	struct abuf utext;
+	struct lindex* index;
+	bool partial;
+	const struct syntax* syntax;
+	u32 hl_lo, hl_hi, hl_top;
+	u32 hl_sync_lo, hl_sync_hi;
+	struct arena arena;
+};
+
+static struct {
+	struct buffer* list;
+	u32 count, cap;
+	u32 cur;
+	u32 last_id;
+	u64 clock;
+} B;
+
+static u32 buffer_add(void) {
+	if (B.count == B.cap) {
+		B.cap = B.cap ? B.cap * 2 : 8;
+		B.list = realloc(B.list, sizeof(*B.list) * B.cap);
+		if (B.list == NULL) die("realloc");
+	}
+	struct buffer* b = &B.list[B.count];
+	memset(b, 0, sizeof(*b));
+	b->id = ++B.last_id;
+	b->watch = -1;
+	b->swap = -1;
+	return B.count++;
+}
+
+// Exchange the editor's buffer state with b's
+static void buffer_swap(struct buffer* b) {
+#define SWAP(f) do { __typeof__(E.f) t_ = E.f; E.f = b->f; b->f = t_; } while (0)
+	SWAP(cx); SWAP(cy);
+	SWAP(row_offset); SWAP(col_offset);
+	SWAP(row_count);
+	SWAP(blocks);
+	SWAP(block_count); SWAP(block_cap);
+	SWAP(last_block); SWAP(last_first);
+	SWAP(dirty);
+	SWAP(filename);
+	SWAP(stamp);
+	SWAP(map); SWAP(map_len); SWAP(map_size);
+	SWAP(view); SWAP(follow);
+	SWAP(watch);
+	SWAP(row_blocks);
+	SWAP(swap); SWAP(noswap);
+	SWAP(urecs); SWAP(urec_count); SWAP(urec_cap);
+	SWAP(usteps); SWAP(ustep_count); SWAP(ustep_cap);
+	SWAP(ustep_pos); SWAP(ustep_saved);
+	SWAP(ustep_open);
+	SWAP(utext);
+	SWAP(index);
+	SWAP(partial);
+	SWAP(syntax);
+	SWAP(hl_lo); SWAP(hl_hi); SWAP(hl_top);
+	SWAP(hl_sync_lo); SWAP(hl_sync_hi);
+#undef SWAP
+	struct arena a = A;
+	A = b->arena;
+	b->arena = a;
+}
+
+static bool buffer_dirty(u32 i) {
+	return i == B.cur ? E.dirty : B.list[i].dirty;
+}
+
+static const char* buffer_name(u32 i) {
+	const char* name = i == B.cur ? E.filename : B.list[i].filename;
+	return name ? name : "[No Name]";
+}
+
+static u64 buffer_cost(struct buffer* b) {
+	return (u64)b->block_count * sizeof(struct rblock) + b->arena.size + b->utext.cap +
+		(u64)b->row_blocks * BLOCK_ROWS * (sizeof(struct erow) + 1) +
+		(u64)b->urec_cap * sizeof(struct urec) + (u64)b->ustep_cap * sizeof(u32);
+}
+
+// Free everything a parked buffer holds but its name and cursor. Registers
+// have to be off the current mapping first, see reg_own(), and the match
+// workers must not be scanning the current buffer's blocks.
+static void buffer_unload(u32 i) {
+	match_stop();
+	struct buffer* b = &B.list[i];
+	buffer_swap(b);
+	swap_remove();
+	rows_free();
+	map_close();
+	undo_reset();
+	buffer_swap(b);
+	b->loaded = false;
+}
+
+static void buffer_trim(void) {
+	while (1) {
+		u64 total = 0;
+		u32 lru = UINT32_MAX;
+		for (u32 i = 0; i < B.count; i++) {
+			struct buffer* b = &B.list[i];
+			if (i == B.cur || !b->loaded) continue;
+			total += buffer_cost(b);
+			if (b->filename && !b->dirty && (lru == UINT32_MAX || b->used < B.list[lru].used)) lru = i;
+		}
+		if (total <= BUFFER_MEMORY || lru == UINT32_MAX) return;
+		buffer_unload(lru);
+	}
+}
+
+// Read the current buffer's file in again, staying where we were
+static void buffer_reload(void) {
+	u32 cx = E.cx, cy = E.cy;
+	u32 row_offset = E.row_offset, col_offset = E.col_offset;
+	open_file(NULL);
+
+	index_wait(cy);
+	E.cy = (cy < E.row_count) ? cy : E.row_count - (E.row_count > 0);
+	u32 len = (E.cy < E.row_count) ? row_at(E.cy)->len : 0;
+	E.cx = (cx < len) ? cx : len;
+	E.row_offset = (row_offset < E.cy) ? row_offset : E.cy;
+	E.col_offset = col_offset;
+}
+
+static void buffer_switch(u32 k) {
+	if (k == B.cur) return;
+	match_stop();
+	reg_own(&E.reg);
+	undo_commit();
+
+	struct buffer* b = &B.list[B.cur];
+	buffer_swap(b);
+	b->loaded = true;
+	b->used = ++B.clock;
+
+	B.cur = k;
+	b = &B.list[k];
+	bool loaded = b->loaded;
+	buffer_swap(b);
+	E.match_ready = false;
+	E.width_gen++;
+	E.row_sub = 0;
+	if (E.wrap) E.col_offset = 0;
+	damage_rows(0, UINT32_MAX);
+	statusmsg_set("");
+
+	// A file that changed on disk is read again, unless that would throw
+	// away changes
+	struct fstamp now;
+	if (!loaded) buffer_reload();
+	else if (E.follow) follow_update();
+	else if (E.filename && file_stamp(E.filename, &now) && !stamp_equal(&now, &E.stamp)) {
+		if (E.dirty) statusmsg_set("\"%s\" changed on disk since it was read", E.filename);
+		else buffer_reload();
+	}
+	index_poll();
+	buffer_trim();
+
+	if (E.statusmsg[0] == '\0') {
+		statusmsg_set("\"%s\"%s %uL", buffer_name(k), E.dirty ? " [modified]" : "", E.row_count);
+	}
+}
+
+// Buffer showing 'path', or UINT32_MAX
+static u32 buffer_find(const char* path) {
+	struct fstamp fs;
+	bool exists = file_stamp(path, &fs);
+	for (u32 i = 0; i < B.count; i++) {
+		const char* name = i == B.cur ? E.filename : B.list[i].filename;
+		const struct fstamp* st = i == B.cur ? &E.stamp : &B.list[i].stamp;
+		if (name == NULL) continue;
+		if (strcmp(name, path) == 0 || (exists && st->dev == fs.dev && st->ino == fs.ino)) return i;
+	}
+	return UINT32_MAX;
+}
+
+// :e FILE (or :view FILE), which switches to FILE's buffer if it already
+// has one. An unnamed, unmodified buffer just gets the file read into it.
+static void buffer_edit(char* path, bool view) {
+	u32 k = buffer_find(path);
+	if (k == B.cur) {
+		if (E.dirty) statusmsg_set("No write since last change");
+		else open_file(NULL);
+	} else if (k != UINT32_MAX) buffer_switch(k);
+	else if (!E.filename && !E.dirty) {
+		E.view = view;
+		open_file(path);
+	} else {
+		k = buffer_add();
+		B.list[k].filename = strdup(path);
+		B.list[k].view = view;
+		buffer_switch(k);
+	}
+}
+
+static void buffer_list(void) {
+	char buf[sizeof(E.statusmsg)];
+	u32 len = 0;
+	for (u32 i = 0; i < B.count && len < sizeof(buf); i++) {
+		u32 id = B.list[i].id;
+		len += snprintf(buf + len, sizeof(buf) - len, "%s%u%s%s \"%s\"", i ? "  " : "", id,
+			i == B.cur ? "%" : "", buffer_dirty(i) ? "+" : "", buffer_name(i));
+	}
+	statusmsg_set("%s", buf);
+}
+
+// Whether another buffer still has changes, switching to it if so
+static bool buffer_unsaved(void) {
+	for (u32 i = 0; i < B.count; i++) {
+		if (i == B.cur || !B.list[i].dirty) continue;
+		buffer_switch(i);
+		statusmsg_set("No write since last change for buffer %u", B.list[i].id);
+		return true;
+	}
+	return false;
+}
+
+static void buffers_free(void) {
+	reg_own(&E.reg);
+	for (u32 i = 0; i < B.count; i++) {
+		if (i == B.cur) continue;
+		if (B.list[i].loaded) buffer_unload(i);
+		free(B.list[i].filename);
+	}
+	free(B.list);
+	memset(&B, 0, sizeof(B));
+}
+
+/*
+ * Search
+ *
+ * Patterns are plain text, where "\n" matches a line break and "\\" a
+ * backslash. Rows are scanned with memmem(), and rows that still sit back
+ * to back in the file mapping are scanned as one piece of memory.
+ */
+static char* prompt(char* msg);
+
+// These scan the rows by block and index instead of going through row_at(),
+// which keeps them safe to use from the match workers
+
+// Does the rest of a multi-line pattern match from the row after (b, i)?
+static bool match_rows(u32 b, u32 i, const char* pat, u32 len) {
+	while (1) {
+		if (++i >= E.blocks[b]->count) {
+			if (++b >= E.block_count) return false;
+			i = 0;
+		}
+		struct erow* row = &block_get(b)->rows[i];
+		const char* nl = memchr(pat, '\n', len);
+		u32 n = nl ? (u32)(nl - pat) : len;
+		if (nl ? row->len != n : row->len < n) return false;
+		if (memcmp(row_chars(row), pat, n) != 0) return false;
+		if (!nl) return true;
+		pat += n + 1;
+		len -= n + 1;
+	}
+}
+
+// Find the first (or last) match in row i of block b that starts in [from, to)
+static bool search_row(u32 b, u32 i, u32 from, u32 to, bool last, u32* at) {
+	struct erow* row = &block_get(b)->rows[i];
+	char* chars = row_chars(row);
+	const char* pat = E.search;
+	u32 plen = E.search_len;
+	if (to > row->len + 1) to = row->len + 1;
+
+	const char* nl = memchr(pat, '\n', plen);
+	if (nl) {
+		// The first line of the pattern has to be the end of the row
+		u32 n = nl - pat;
+		if (n > row->len) return false;
+		u32 x = row->len - n;
+		if (x < from || x >= to) return false;
+		if (memcmp(&chars[x], pat, n) != 0 || !match_rows(b, i, nl + 1, plen - n - 1)) return false;
+		*at = x;
+		return true;
+	}
+
+	bool found = false;
+	for (u32 x = from; x < to && x + plen <= row->len; ) {
+		char* hit = memmem(&chars[x], row->len - x, pat, plen);
+		if (hit == NULL || (u32)(hit - chars) >= to) break;
+		*at = hit - chars;
+		found = true;
+		if (!last) break;
+		x = *at + 1;
+	}
+	return found;
+}
+
+static bool row_follows(struct erow* a, struct erow* b) {
+	return a->cap == 0 && b->cap == 0 && b->chars == a->chars + a->len + 1;
+}
+
+// Turn a hit in a run of mapped rows [lo, hi) of a block into a position
+static pos_t run_pos(struct rblock* blk, u32 first, u32 lo, u32 hi, char* hit) {
+	while (hi - lo > 1) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (blk->rows[mid].chars <= hit) lo = mid;
+		else hi = mid;
+	}
+	return (pos_t){ hit - blk->rows[lo].chars, first + lo };
+}
+
+// First match at or after p, waiting for more of the file as needed
+static bool search_forward(pos_t p, pos_t* out) {
+	bool multi = memchr(E.search, '\n', E.search_len) != NULL;
+
+	for (u32 y = p.y, x = p.x; ; x = 0) {
+		view_trim();
+		if (y >= E.row_count) index_wait(y);
+		if (y >= E.row_count) break;
+
+		u32 first;
+		u32 b = block_find(y, &first);
+		struct rblock* blk = block_get(b);
+		u32 i = y - first, end = i + 1;
+		if (!multi) while (end < blk->count && row_follows(&blk->rows[end - 1], &blk->rows[end])) end++;
+
+		if (end - i > 1) {
+			struct erow* row = &blk->rows[i];
+			struct erow* last = &blk->rows[end - 1];
+			char* s = row_chars(row) + (x < row->len ? x : row->len);
+			char* hit = memmem(s, row_chars(last) + last->len - s, E.search, E.search_len);
+			if (hit) {
+				*out = run_pos(blk, first, i, end, hit);
+				return true;
+			}
+		} else if (search_row(b, i, x, UINT32_MAX, false, &out->x)) {
+			out->y = y;
+			return true;
+		}
+		y = first + end;
+	}
+	return false;
+}
+
+// Last match that starts before p
+static bool search_backward(pos_t p, pos_t* out) {
+	bool multi = memchr(E.search, '\n', E.search_len) != NULL;
+	if (E.row_count == 0) return false;
+	if (p.y >= E.row_count) p = (pos_t){ UINT32_MAX, E.row_count - 1 };
+
+	for (u32 y = p.y, to = p.x; y != UINT32_MAX; to = UINT32_MAX) {
+		view_trim();
+		u32 first;
+		u32 b = block_find(y, &first);
+		struct rblock* blk = block_get(b);
+		u32 i = y - first, start = i;
+		if (!multi) while (start > 0 && row_follows(&blk->rows[start - 1], &blk->rows[start])) start--;
+
+		if (i - start > 0) {
+			struct erow* row = &blk->rows[i];
+			char* s = row_chars(&blk->rows[start]);
+			char* end = row_chars(row) + row->len;
+			char* limit = row_chars(row) + (to < row->len ? to : row->len);
+			char* hit = NULL;
+			for (char* h; s < end && (h = memmem(s, end - s, E.search, E.search_len)) && h < limit; s = h + 1) hit = h;
+			if (hit) {
+				*out = run_pos(blk, first, start, i + 1, hit);
+				return true;
+			}
+		} else if (search_row(b, i, 0, to, true, &out->x)) {
+			out->y = y;
+			return true;
+		}
+		y = first + start - 1;
+	}
+	return false;
+}
+
+/*
+ * Match counting
+ *
+ * A pool of worker threads fills in the stale match caches of the blocks in
+ * the background. The workers only read the rows, so anything that changes
+ * them calls match_stop() first and then drops the caches of the blocks it
+ * touched; the next round only has to rescan those. Once every block is up
+ * to date, a prefix sum over the blocks turns n, N and :match into binary
+ * searches.
+ */
+struct mslot { u32 before, first; };	// Matches and rows before a block
+
+static struct {
+	pthread_t threads[MAX_WORKERS];
+	u32 thread_count;
+	pthread_mutex_t lock;
+	pthread_cond_t work, idle;
+	u32 next, end;		// Blocks still to be handed out
+	u32 active;
+} S = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+
+static void match_push(struct bmatch** m, u32* n, u32* cap, u32 row, u32 x) {
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 16;
+		*m = realloc(*m, sizeof(**m) * *cap);
+		if (*m == NULL) die("realloc");
+	}
+	(*m)[(*n)++] = (struct bmatch){ row, x };
+}
+
+// Scan a lazy block right in the mapping, placing hits by counting
+// newlines, so it doesn't have to be split up. A pattern with a line break
+// may run on past the block, and into rows that have lost a \r, so that's
+// only left to this in a read-only buffer and without any \r in reach.
+static bool block_scan_lazy(struct rblock* blk, bool multi, struct bmatch** m, u32* n, u32* cap) {
+	char* s = __atomic_load_n(&blk->lazy, __ATOMIC_ACQUIRE);
+	if (s == NULL || (multi && !E.view)) return false;
+
+	char* end = blk->lazy_end;
+	char* limit = end;
+	char* eof = E.map + E.map_len;
+	if (multi) {
+		limit = ((u64)(eof - end) > E.search_len) ? end + E.search_len : eof;
+		if (memchr(s, '\r', limit - s)) return false;
+	}
+
+	// A pattern ending in a line break needs a row after it
+	bool need_row = E.search[E.search_len - 1] == '\n';
+	u32 row = 0;
+	char* line = s;
+	for (char* hit; s < end && (hit = memmem(s, limit - s, E.search, E.search_len)) && hit < end; s = hit + 1) {
+		if (need_row && hit + E.search_len == eof) break;
+		for (char* nl; (nl = memchr(line, '\n', hit - line)) != NULL; line = nl + 1) row++;
+		match_push(m, n, cap, row, hit - line);
+	}
+	if (E.view) pages_drop(blk->lazy, end - blk->lazy);
+	return true;
+}
+
+static void block_scan(u32 b) {
+	struct rblock* blk = E.blocks[b];
+	if (blk->match_gen == E.search_gen) return;
+
+	bool multi = memchr(E.search, '\n', E.search_len) != NULL;
+	struct bmatch* m = NULL;
+	u32 n = 0, cap = 0;
+	if (block_scan_lazy(blk, multi, &m, &n, &cap)) goto done;
+	block_get(b);
+
+	for (u32 i = 0; i < blk->count; ) {
+		u32 end = i + 1;
+		if (!multi) while (end < blk->count && row_follows(&blk->rows[end - 1], &blk->rows[end])) end++;
+
+		char* s = row_chars(&blk->rows[i]);
+		char* e = row_chars(&blk->rows[end - 1]) + blk->rows[end - 1].len;
+		for (u32 x = 0; ; ) {
+			pos_t p;
+			char* hit;
+			if (end - i > 1) {
+				if (s >= e || (hit = memmem(s, e - s, E.search, E.search_len)) == NULL) break;
+				p = run_pos(blk, 0, i, end, hit);
+				s = hit + 1;
+			} else {
+				if (!search_row(b, i, x, UINT32_MAX, false, &p.x)) break;
+				p.y = i;
+				x = p.x + 1;
+			}
+
+			match_push(&m, &n, &cap, p.y, p.x);
+		}
+		i = end;
+	}
+
+done:
+	free(blk->matches);
+	blk->matches = m;
+	blk->match_count = n;
+	blk->match_gen = E.search_gen;
+}
+
+static void* match_worker(void* arg) {
+	(void)arg;
+	sigset_t set;
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&S.lock);
+	while (1) {
+		while (S.next >= S.end) pthread_cond_wait(&S.work, &S.lock);
+		u32 b = S.next++;
+		S.active++;
+		pthread_mutex_unlock(&S.lock);
+
+		block_scan(b);
+
+		pthread_mutex_lock(&S.lock);
+		S.active--;
+		if (S.next >= S.end && S.active == 0) {
+			pthread_cond_broadcast(&S.idle);
+			write(E.wake_pipe[1], "m", 1);
+		}
+	}
+	return NULL;
+}
+
+// Hand out the blocks whose caches are stale to the workers
+static void match_start(void) {
+	if (E.search == NULL || E.match_ready) return;
+
+	pthread_mutex_lock(&S.lock);
+	if (S.next < S.end || S.active > 0) {
+		pthread_mutex_unlock(&S.lock);
+		return;
+	}
+
+	if (S.thread_count == 0) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		n = (n < 1) ? 1 : (n > MAX_WORKERS) ? MAX_WORKERS : n;
+		while (S.thread_count < n && pthread_create(&S.threads[S.thread_count], NULL, match_worker, NULL) == 0) S.thread_count++;
+	}
+
+	S.next = 0;
+	S.end = S.thread_count ? E.block_count : 0;
+	pthread_cond_broadcast(&S.work);
+	pthread_mutex_unlock(&S.lock);
+}
+
+// Wait for the workers to be done, 'cancel' stops them after their current block
+static void match_wait(bool cancel) {
+	pthread_mutex_lock(&S.lock);
+	if (cancel) S.end = S.next;
+	while (S.next < S.end || S.active > 0) pthread_cond_wait(&S.idle, &S.lock);
+	pthread_mutex_unlock(&S.lock);
+}
+
+static void match_stop(void) {
+	match_wait(true);
+}
+
+// Build the prefix sums once all blocks are scanned
+static bool match_index_ready(void) {
+	if (E.match_ready) return true;
+	if (E.search == NULL || E.index) return false;
+
+	pthread_mutex_lock(&S.lock);
+	bool busy = S.next < S.end || S.active > 0;
+	pthread_mutex_unlock(&S.lock);
+	if (busy) return false;
+
+	for (u32 b = 0; b < E.block_count; b++) {
+		if (E.blocks[b]->match_gen != E.search_gen) return false;
+	}
+
+	free(E.match_index);
+	E.match_index = malloc(sizeof(*E.match_index) * (E.block_count + 1));
+	if (E.match_index == NULL) die("malloc");
+
+	struct mslot at = { 0, 0 };
+	for (u32 b = 0; b < E.block_count; b++) {
+		E.match_index[b] = at;
+		at.before += E.blocks[b]->match_count;
+		at.first += E.blocks[b]->count;
+	}
+	E.match_index[E.block_count] = at;
+	E.match_ready = true;
+	return true;
+}
+
+static u32 match_total(void) {
+	return E.match_index[E.block_count].before;
+}
+
+// The number of matches before p, or up to and including p
+static u32 match_rank(pos_t p, bool inclusive) {
+	if (E.row_count == 0) return 0;
+	if (p.y >= E.row_count) p.y = E.row_count - 1;
+
+	u32 first;
+	u32 b = block_find(p.y, &first);
+	struct rblock* blk = E.blocks[b];
+	u32 row = p.y - first, lo = 0, hi = blk->match_count;
+	while (lo < hi) {
+		u32 mid = lo + (hi - lo) / 2;
+		struct bmatch* m = &blk->matches[mid];
+		if (m->row < row || (m->row == row && (m->x < p.x || (inclusive && m->x == p.x)))) lo = mid + 1;
+		else hi = mid;
+	}
+	return E.match_index[b].before + lo;
+}
+
+static pos_t match_pos(u32 k) {
+	u32 lo = 0, hi = E.block_count;
+	while (hi - lo > 1) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (E.match_index[mid].before <= k) lo = mid;
+		else hi = mid;
+	}
+	struct bmatch* m = &E.blocks[lo]->matches[k - E.match_index[lo].before];
+	return (pos_t){ m->x, E.match_index[lo].first + m->row };
+}
+
+static pos_t search_next(pos_t p, u32 count, bool back) {
+	if (E.search == NULL) {
+		statusmsg_set("No previous pattern");
+		return p;
+	}
+	if (back) index_wait(UINT32_MAX);
+
+	if (match_index_ready()) {
+		i64 total = match_total();
+		if (total == 0) {
+			statusmsg_set("Pattern not found: %s", E.search_str);
+			return p;
+		}
+
+		i64 k = back ? (i64)match_rank(p, false) - count : (i64)match_rank(p, true) + count - 1;
+		if (k < 0 || k >= total) statusmsg_set(back ? "search hit TOP, continuing at BOTTOM" : "search hit BOTTOM, continuing at TOP");
+		k %= total;
+		return match_pos(k < 0 ? k + total : k);
+	}
+
+	for (u32 i = 0; i < count; i++) {
+		pos_t hit;
+		bool found = back ? search_backward(p, &hit) : search_forward((pos_t){ p.x + 1, p.y }, &hit);
+		if (!found) {
+			found = back ? search_backward((pos_t){ UINT32_MAX, UINT32_MAX }, &hit) : search_forward((pos_t){ 0, 0 }, &hit);
+			if (found) statusmsg_set(back ? "search hit TOP, continuing at BOTTOM" : "search hit BOTTOM, continuing at TOP");
+		}
+		if (!found) {
+			statusmsg_set("Pattern not found: %s", E.search_str);
+			break;
+		}
+		p = hit;
+	}
+	return p;
+}
+
+// Read a new pattern, an empty one searches for the last pattern again
+static bool search_prompt(bool back) {
+	u8 mode = E.mode;
+	E.mode = M_COMMAND;
+	char* str = prompt(back ? "?%s" : "/%s");
+	E.mode = mode;
+	if (str == NULL) return false;
+
+	E.search_back = back;
+	if (*str == '\0') {
+		free(str);
+		return true;
+	}
+
+	match_stop();
+	free(E.search_str);
+	free(E.search);
+	E.search_gen++;
+	E.match_ready = false;
+	E.search_str = str;
+	E.search = malloc(strlen(str) + 1);
+	if (E.search == NULL) die("malloc");
+
+	u32 n = 0;
+	for (char* c = str; *c; c++) {
+		if (*c == '\\' && c[1] == 'n') { E.search[n++] = '\n'; c++; }
+		else if (*c == '\\' && c[1] == '\\') { E.search[n++] = '\\'; c++; }
+		else E.search[n++] = *c;
+	}
+	E.search_len = n;
+	return true;
+}
+
+/*
+ * Display width
+ *
+ * Rows are UTF-8 and the cursor sits on a byte offset, while the screen
+ * counts columns. Longer rows get a checkpoint every WIDTH_STEP bytes so
+ * mapping between the two only walks from the closest one. Checkpoints are
+ * only laid as far into the row as something has looked, and runs of plain
+ * ASCII without tabs (which map one to one) are checked 16 bytes at a time.
+ * An edit keeps those before it (see width_edited()), only inserted or
+ * deleted rows throw them all out. With wrapping on, the same entry keeps
+ * where the row's visual lines start, for the width they were worked out for.
+ */
+struct wmark { u32 x, col; };
+static struct wrow {
+	u32 y, gen;
+	u32 end_x, end_col;	// How far the checkpoints go
+	u32 plain_x;		// All bytes before it (or end_x) are plain
+	struct wmark* marks;
+	u32 count, cap;
+	u32 wrap_cols;
+	bool wrap_done;
+	struct wmark* wraps;
+	u32 wrap_count, wrap_cap;
+} W[WIDTH_CACHE];
+
+// Decode the character at s and return its length. A malformed byte comes
+// out on its own as UINT32_MAX.
+static u32 utf8_decode(const u8* s, u32 n, u32* cp) {
+	u8 c = s[0];
+	u32 len = (c < 0x80) ? 1 : (c < 0xC2) ? 0 : (c < 0xE0) ? 2 : (c < 0xF0) ? 3 : (c < 0xF5) ? 4 : 0;
+	*cp = UINT32_MAX;
+	if (len == 1) *cp = c;
+	if (len <= 1 || len > n) return 1;
+
+	u32 v = c & (0x7F >> len);
+	for (u32 i = 1; i < len; i++) {
+		if ((s[i] & 0xC0) != 0x80) return 1;
+		v = (v << 6) | (s[i] & 0x3F);
+	}
+	// Overlong forms, surrogates and anything past U+10FFFF
+	if ((len == 3 && v < 0x800) || (len == 4 && (v < 0x10000 || v > 0x10FFFF)) || (v >= 0xD800 && v <= 0xDFFF)) return 1;
+	*cp = v;
+	return len;
+}
+
+// Columns a decoded character takes up, or -1 if it can't be shown as is
+static int cp_cols(u32 cp) {
+	if (cp < 0x80) return 1;
+	return cp == UINT32_MAX ? -1 : wcwidth(cp);
+}
+
+// Columns for the character at s when it starts at column col. Whatever
+// can't be shown gets one column for a replacement character.
+static u32 char_cols(const u8* s, u32 n, u32 col, u32* len) {
+	*len = 1;
+	if (*s == '\t') return TAB_SIZE - col % TAB_SIZE;
+	if (*s < 0x80) return 1;
+
+	u32 cp;
+	*len = utf8_decode(s, n, &cp);
+	int w = cp_cols(cp);
+	return w < 0 ? 1 : w;
+}
+
+static bool bytes_plain(const u8* s, u32 n) {
+	u32 i = 0;
+#ifdef __SSE2__
+	__m128i tab = _mm_set1_epi8('\t');
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+		if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, tab)))) return false;
+	}
+#endif
+	for (; i < n; i++) if (s[i] >= 0x80 || s[i] == '\t') return false;
+	return true;
+}
+
+// Lay the checkpoints of row y out past byte x (or column col)
+static struct wrow* width_marks(u32 y, struct erow* row, u32 x, u32 col) {
+	struct wrow* w = &W[y % WIDTH_CACHE];
+	if (w->gen != E.width_gen || w->y != y) {
+		w->y = y;
+		w->gen = E.width_gen;
+		w->count = 0;
+		w->end_x = w->end_col = 0;
+		w->plain_x = UINT32_MAX;
+		w->wrap_cols = w->wrap_count = 0;
+	}
+
+	const u8* s = (const u8*)row_chars(row);
+	u32 at = w->end_x, at_col = w->end_col;
+	while (at < row->len && (x != UINT32_MAX ? at <= x : at_col <= col)) {
+		if (w->count == w->cap) {
+			w->cap = w->cap ? w->cap * 2 : 16;
+			w->marks = realloc(w->marks, sizeof(*w->marks) * w->cap);
+			if (w->marks == NULL) die("realloc");
+		}
+		w->marks[w->count++] = (struct wmark){ at, at_col };
+
+		u32 end = w->count * WIDTH_STEP < row->len ? w->count * WIDTH_STEP : row->len;
+		if (bytes_plain(s + at, end - at)) {
+			at_col += end - at;
+			at = end;
+			continue;
+		}
+		if (w->plain_x == UINT32_MAX) w->plain_x = at;
+		for (u32 len; at < end; at += len) at_col += char_cols(s + at, row->len - at, at_col, &len);
+	}
+	w->end_x = at;
+	w->end_col = at_col;
+	return w;
+}
+
+// Whether the row is plain ASCII all through, once width_marks() has been
+// over all of it
+static bool width_plain(struct wrow* w, struct erow* row) {
+	return w->plain_x == UINT32_MAX && w->end_x >= row->len;
+}
+
+// Row y changed from byte x on. Checkpoints and visual lines starting before
+// that still hold, the rest are laid again from the last of them. A character
+// decoded up to 3 bytes before x may have reached into the change.
+static void width_edited(u32 y, u32 x) {
+	struct wrow* w = &W[y % WIDTH_CACHE];
+	if (w->gen != E.width_gen || w->y != y) return;
+
+	while (w->count > 0 && w->marks[w->count - 1].x + 4 > x) w->count--;
+	struct wmark m = w->count > 0 ? w->marks[--w->count] : (struct wmark){ 0, 0 };
+	w->end_x = m.x;
+	w->end_col = m.col;
+	if (w->plain_x >= w->end_x) w->plain_x = UINT32_MAX;
+
+	while (w->wrap_count > 1 && w->wraps[w->wrap_count - 1].x + 4 > x) w->wrap_count--;
+	w->wrap_done = false;
+}
+
+// The checkpoint to start walking from towards byte x (or column col)
+static struct wmark width_start(u32 y, struct erow* row, u32 x, u32 col) {
+	if (row->len <= WIDTH_STEP) return (struct wmark){ 0, 0 };
+
+	struct wrow* w = width_marks(y, row, x, col);
+	u32 at = (x != UINT32_MAX) ? x : col;
+	u32 plain = w->plain_x < w->end_x ? w->plain_x : w->end_x;
+	if (at <= plain) return (struct wmark){ at, at };
+
+	u32 lo = 0, hi = w->count;
+	while (hi - lo > 1) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (x != UINT32_MAX ? w->marks[mid].x <= x : w->marks[mid].col <= col) lo = mid;
+		else hi = mid;
+	}
+	return w->marks[lo];
+}
+
+// Column that byte x of row y is drawn at
+static u32 row_col(u32 y, u32 x) {
+	if (y >= E.row_count) return 0;
+	struct erow* row = row_at(y);
+	if (x > row->len) x = row->len;
+
+	struct wmark m = width_start(y, row, x, 0);
+	const u8* s = (const u8*)row_chars(row);
+	for (u32 len; m.x < x; m.x += len) m.col += char_cols(s + m.x, row->len - m.x, m.col, &len);
+	return m.col;
+}
+
+// The byte of the character in row y that covers column col (or the end of
+// the row), with the column that character starts at in *start
+static u32 row_byte(u32 y, u32 col, u32* start) {
+	*start = 0;
+	if (y >= E.row_count) return 0;
+	struct erow* row = row_at(y);
+
+	struct wmark m = width_start(y, row, UINT32_MAX, col);
+	const u8* s = (const u8*)row_chars(row);
+	while (m.x < row->len) {
+		u32 len, w = char_cols(s + m.x, row->len - m.x, m.col, &len);
+		if (m.col + w > col) break;
+		m.col += w;
+		m.x += len;
+	}
+	*start = m.col;
+	return m.x;
+}
+
+// Step over a character and any zero width ones combining with it
+static u32 char_next(struct erow* row, u32 x) {
+	const u8* s = (const u8*)row_chars(row);
+	u32 cp;
+	if (x >= row->len) return x;
+	x += utf8_decode(s + x, row->len - x, &cp);
+	while (x < row->len) {
+		u32 len = utf8_decode(s + x, row->len - x, &cp);
+		if (cp_cols(cp) != 0) break;
+		x += len;
+	}
+	return x;
+}
+
+static u32 char_prev(struct erow* row, u32 x) {
+	const u8* s = (const u8*)row_chars(row);
+	if (x > row->len) x = row->len;
+	while (x > 0) {
+		// Back up to where a sequence ending at x would start
+		u32 at = x - 1, cp = UINT32_MAX;
+		while (at > 0 && x - at < 4 && (s[at] & 0xC0) == 0x80) at--;
+		if (utf8_decode(s + at, row->len - at, &cp) != x - at) {
+			at = x - 1;
+			cp = UINT32_MAX;
+		}
+		x = at;
+		if (cp_cols(cp) != 0) break;
+	}
+	return x;
+}
+
+static void wrap_push(struct wrow* w, struct wmark m) {
+	if (w->wrap_count == w->wrap_cap) {
+		w->wrap_cap = w->wrap_cap ? w->wrap_cap * 2 : 16;
+		w->wraps = realloc(w->wraps, sizeof(*w->wraps) * w->wrap_cap);
+		if (w->wraps == NULL) die("realloc");
+	}
+	w->wraps[w->wrap_count++] = m;
+}
+
+// Where the visual lines of row y start when it wraps at 'cols'. A
+// character that doesn't fit on the rest of a line moves down whole, so
+// only rows of plain ASCII can simply be cut every 'cols' columns.
+static struct wrow* wrap_marks(u32 y, struct erow* row, u32 cols) {
+	struct wrow* w = width_marks(y, row, row->len, 0);
+	if (width_plain(w, row)) return w;
+	if (w->wrap_cols != cols) {
+		w->wrap_cols = cols;
+		w->wrap_count = 0;
+		w->wrap_done = false;
+	}
+	if (w->wrap_done) return w;
+
+	// Carry on from the last line still known to start where it does
+	const u8* s = (const u8*)row_chars(row);
+	if (w->wrap_count == 0) wrap_push(w, (struct wmark){ 0, 0 });
+	struct wmark m = w->wraps[w->wrap_count - 1];
+	for (u32 x = m.x, col = m.col, start = m.col, len; x < row->len; x += len) {
+		u32 cw = char_cols(s + x, row->len - x, col, &len);
+		if (col + cw > start + cols && col > start) wrap_push(w, (struct wmark){ x, start = col });
+		col += cw;
+	}
+	w->wrap_done = true;
+	return w;
+}
+
+static u32 text_cols(void);
+
+// Screen lines row y takes up
+static u32 row_height(u32 y) {
+	u32 cols = text_cols();
+	if (!E.wrap || y >= E.row_count || cols == 0) return 1;
+	// Only a tab can take up more columns than it has bytes
+	struct erow* row = row_at(y);
+	if (row->len <= cols && memchr(row_chars(row), '\t', row->len) == NULL) return 1;
+
+	struct wrow* w = wrap_marks(y, row, cols);
+	return width_plain(w, row) ? (row->len + cols - 1) / cols : w->wrap_count;
+}
+
+// Column visual line 'sub' of row y starts at
+static u32 wrap_col(u32 y, u32 sub) {
+	if (sub == 0) return 0;
+	struct erow* row = row_at(y);
+	struct wrow* w = wrap_marks(y, row, text_cols());
+	return width_plain(w, row) ? sub * text_cols() : w->wraps[sub].col;
+}
+
+// Visual line of row y that column col is on
+static u32 wrap_line(u32 y, u32 col) {
+	u32 h = row_height(y);
+	if (h == 1) return 0;
+
+	struct erow* row = row_at(y);
+	struct wrow* w = wrap_marks(y, row, text_cols());
+	if (width_plain(w, row)) return (col / text_cols() < h) ? col / text_cols() : h - 1;
+	u32 lo = 0, hi = w->wrap_count;
+	while (hi - lo > 1) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (w->wraps[mid].col <= col) lo = mid;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// Step n visual lines down (or up) from line p.x of row p.y, stopping at
+// either end of the buffer. This only ever looks at the rows in between.
+static pos_t vline_down(pos_t p, u32 n) {
+	while (n > 0) {
+		u32 h = row_height(p.y);
+		if (p.x + n < h) {
+			p.x += n;
+			break;
+		}
+		if (p.y + 1 >= E.row_count) {
+			p.x = h - 1;
+			break;
+		}
+		n -= h - p.x;
+		p.y++;
+		p.x = 0;
+	}
+	return p;
+}
+
+static pos_t vline_up(pos_t p, u32 n) {
+	while (n > 0) {
+		if (p.x >= n) {
+			p.x -= n;
+			break;
+		}
+		if (p.y == 0) {
+			p.x = 0;
+			break;
+		}
+		n -= p.x + 1;
+		p.y--;
+		p.x = row_height(p.y) - 1;
+	}
+	return p;
+}
+
+// Visual lines from a down to b, or 'limit' if that's as far or further
+static u32 vline_dist(pos_t a, pos_t b, u32 limit) {
+	u32 d = 0;
+	while (a.y < b.y && d < limit) {
+		d += row_height(a.y) - a.x;
+		a.y++;
+		a.x = 0;
+	}
+	if (a.y == b.y && b.x > a.x) d += b.x - a.x;
+	return d < limit ? d : limit;
+}
+
+static void width_free(void) {
+	for (u32 i = 0; i < WIDTH_CACHE; i++) {
+		free(W[i].marks);
+		free(W[i].wraps);
+	}
+	memset(W, 0, sizeof(W));
+}
+
+/*
+ * Syntax highlighting
+ *
+ * Every row remembers the state the lexer ended it in, which is all the
+ * next row needs to be lexed on its own. Rows above E.hl_lo can be trusted.
+ * An edit pulls hl_lo back to the edited row and re-lexing walks forward
+ * from there, until a row past the last edit (hl_hi) ends in the state it
+ * had before, which makes everything up to where lexing had got to before
+ * (hl_top) right again. Only the rows on screen get lexed, plus the ones
+ * between them and hl_lo, or HL_SYNC rows above the screen after a jump
+ * further than that. Lexing those starts on a guess, and the run of rows
+ * lexed on from it (hl_sync_lo to hl_sync_hi) is trusted too, until an edit
+ * cuts it short or lexing from hl_lo catches up with it.
+ */
+struct syntax {
+	const char* name;
+	const char** match;	// File name suffixes (starting with a '.') or names
+	const char** keywords;
+	const char** types;
+	const char* line_comment;
+	const char* block_start;
+	const char* block_end;
+	bool preproc;
+};
+
+static const char* C_MATCH[] = { ".c", ".h", ".cc", ".cpp", ".cxx", ".hpp", NULL };
+static const char* C_KEYWORDS[] = {
+	"break", "case", "const", "continue", "default", "do", "else", "enum", "extern",
+	"for", "goto", "if", "inline", "noreturn", "register", "restrict", "return",
+	"sizeof", "static", "struct", "switch", "typedef", "union", "volatile", "while", NULL
+};
+static const char* C_TYPES[] = {
+	"bool", "char", "double", "float", "int", "long", "short", "signed", "unsigned",
+	"void", "size_t", "ssize_t", "u8", "u16", "u32", "u64", "i8", "i16", "i32", "i64",
+	"uint8_t", "uint16_t", "uint32_t", "uint64_t", "int8_t", "int16_t", "int32_t", "int64_t", NULL
+};
+
+static const char* PY_MATCH[] = { ".py", NULL };
+static const char* PY_KEYWORDS[] = {
+	"and", "as", "assert", "break", "class", "continue", "def", "del", "elif", "else",
+	"except", "finally", "for", "from", "global", "if", "import", "in", "is", "lambda",
+	"nonlocal", "not", "or", "pass", "raise", "return", "try", "while", "with", "yield", NULL
+};
+static const char* PY_TYPES[] = { "None", "True", "False", "self", NULL };
+
+static const char* SH_MATCH[] = { ".sh", ".bash", "makefile", "Makefile", ".mk", NULL };
+static const char* SH_KEYWORDS[] = {
+	"case", "do", "done", "elif", "else", "esac", "export", "fi", "for", "function",
+	"if", "in", "local", "return", "then", "until", "while", NULL
+};
+static const char* NO_WORDS[] = { NULL };
+
+static const struct syntax SYNTAXES[] = {
+	{ "c", C_MATCH, C_KEYWORDS, C_TYPES, "//", "/*", "*/", true },
+	{ "python", PY_MATCH, PY_KEYWORDS, PY_TYPES, "#", NULL, NULL, false },
+	{ "shell", SH_MATCH, SH_KEYWORDS, NO_WORDS, "#", NULL, NULL, false },
+};
+
+static void syntax_select(void) {
+	const struct syntax* syn = NULL;
+	const char* name = E.filename ? strrchr(E.filename, '/') : NULL;
+	name = name ? name + 1 : E.filename;
+
+	for (u32 i = 0; name && !syn && i < sizeof(SYNTAXES) / sizeof(*SYNTAXES); i++) {
+		for (const char** m = SYNTAXES[i].match; *m; m++) {
+			u32 n = strlen(name), k = strlen(*m);
+			if ((*m)[0] == '.' ? (n > k && memcmp(name + n - k, *m, k) == 0) : strcmp(name, *m) == 0) {
+				syn = &SYNTAXES[i];
+				break;
+			}
+		}
+	}
+	if (syn == E.syntax) return;
+
+	// States cached under another syntax mustn't be taken as still right
+	E.syntax = syn;
+	E.hl_lo = E.hl_top = 0;
+	E.hl_hi = E.row_count;
+	E.hl_sync_lo = E.hl_sync_hi = 0;
+	damage_rows(0, UINT32_MAX);
+}
+
+// Rows from y on have changed and 'shift' rows were inserted at y (or
+// removed, when it's negative), so the marks past y move along
+static void hl_edited(u32 y, i32 shift) {
+	u32* marks[] = { &E.hl_hi, &E.hl_top, &E.hl_sync_lo, &E.hl_sync_hi };
+	for (u32 i = 0; i < 4; i++) {
+		u32 v = *marks[i];
+		if (v <= y) continue;
+		*marks[i] = (shift < 0 && v - y < (u32)-shift) ? y : v + shift;
+	}
+	if (E.hl_lo > y) E.hl_lo = y;
+	if (E.hl_hi < y + 1) E.hl_hi = y + 1;
+	if (E.hl_sync_lo <= y && E.hl_sync_hi > y) E.hl_sync_hi = y;
+	if (E.hl_sync_hi <= E.hl_sync_lo) E.hl_sync_lo = E.hl_sync_hi = 0;
+}
+
+static bool hl_word(const u8* s, u32 n, const char** words) {
+	for (; *words; words++) {
+		if ((*words)[0] == s[0] && strlen(*words) == n && memcmp(*words, s, n) == 0) return true;
+	}
+	return false;
+}
+
+static bool starts_with(const u8* s, u32 n, const char* with) {
+	u32 k = strlen(with);
+	return k <= n && memcmp(s, with, k) == 0;
+}
+
+// Lex row y starting out in 'state' and return the state it ends in. If
+// 'out' isn't NULL it gets the class of each of the first HL_MAX_BYTES bytes.
+static u8 hl_lex(u32 y, u8 state, u8* out) {
+	const struct syntax* syn = E.syntax;
+	struct erow* row = row_at(y);
+	const u8* s = (const u8*)row_chars(row);
+	u32 n = row->len < HL_MAX_BYTES ? row->len : HL_MAX_BYTES;
+
+	u32 x = 0;
+	while (x < n && char_class[s[x]] == CC_BLANK) x++;
+	if (out) memset(out, HL_NORMAL, x);
+	bool line_start = true;
+
+	while (x < n) {
+		u32 start = x;
+		u8 c = s[x], hl = HL_NORMAL;
+		if (state == HS_COMMENT) {
+			const u8* end = memmem(s + x, n - x, syn->block_end, strlen(syn->block_end));
+			x = end ? (u32)(end - s) + strlen(syn->block_end) : n;
+			if (end) state = HS_NORMAL;
+			hl = HL_COMMENT;
+		} else if (syn->line_comment && starts_with(s + x, n - x, syn->line_comment)) {
+			x = n;
+			hl = HL_COMMENT;
+		} else if (syn->block_start && starts_with(s + x, n - x, syn->block_start)) {
+			x += strlen(syn->block_start);
+			state = HS_COMMENT;
+			hl = HL_COMMENT;
+		} else if (c == '"' || c == '\'') {
+			for (x++; x < n && s[x] != c; x++) if (s[x] == '\\') x++;
+			if (x < n) x++;
+			else x = n;
+			hl = HL_STRING;
+		} else if (c == '#' && syn->preproc && line_start) {
+			// Up to a comment, which gets coloured as one
+			for (x++; x < n; x++) {
+				if (starts_with(s + x, n - x, syn->line_comment)) break;
+				if (starts_with(s + x, n - x, syn->block_start)) break;
+			}
+			hl = HL_PREPROC;
+		} else if (char_class[c] == CC_WORD) {
+			bool number = c >= '0' && c <= '9';
+			while (x < n && (char_class[s[x]] == CC_WORD || (number && s[x] == '.'))) x++;
+			if (number) hl = HL_NUMBER;
+			else if (hl_word(s + start, x - start, syn->keywords)) hl = HL_KEYWORD;
+			else if (hl_word(s + start, x - start, syn->types)) hl = HL_TYPE;
+		} else x++;
+
+		if (out) memset(out + start, hl, x - start);
+		line_start = false;
+	}
+	return state;
+}
+
+// Whether the state row y ended in can be used as it is
+static bool hl_trusted(u32 y) {
+	return y < E.hl_lo || (y >= E.hl_sync_lo && y < E.hl_sync_hi);
+}
+
+static u8 hl_state(u32 y) {
+	u32 first;
+	u32 b = block_find(y, &first);
+	u8* hl = E.blocks[b]->hl;
+	return hl ? hl[y - first] : HL_UNKNOWN;
+}
+
+// Store the state row y ended in. Rows below it on screen were drawn with
+// the old one, so they need redrawing if it changed.
+static void hl_done(u32 y, u8 state) {
+	u32 first;
+	u32 b = block_find(y, &first);
+	u8 old = E.blocks[b]->hl[y - first];
+	E.blocks[b]->hl[y - first] = state;
+	if (state != old) damage_rows(y + 1, UINT32_MAX);
+
+	if (y == E.hl_lo) {
+		E.hl_lo++;
+		if (E.hl_top < E.hl_lo) E.hl_top = E.hl_lo;
+		if (E.hl_lo >= E.hl_hi && state == old) E.hl_lo = E.hl_top;
+
+		// Caught up with the synced run. Once a row in it ends the way it
+		// did, the guess has come out right from there on.
+		if (E.hl_sync_hi > E.hl_sync_lo && E.hl_lo > E.hl_sync_lo) {
+			if (state == old && E.hl_lo < E.hl_sync_hi) E.hl_lo = E.hl_sync_hi;
+			if (E.hl_top < E.hl_lo) E.hl_top = E.hl_lo;
+			E.hl_sync_lo = E.hl_sync_hi = 0;
+		}
+		return;
+	}
+	if (y == E.hl_sync_hi && y > E.hl_lo) E.hl_sync_hi++;
+	if (y > E.hl_lo && E.hl_hi <= y) E.hl_hi = y + 1;
+}
+
+// The state row y starts in. If that's too far past the trusted rows, the
+// lexer starts fresh HL_SYNC rows up and what it stores there is marked
+// as a guess by pushing hl_hi past it, while the run it starts is trusted.
+static u8 hl_start(u32 y) {
+	if (y == 0 || y > E.row_count) return HS_NORMAL;
+	if (hl_trusted(y - 1)) return hl_state(y - 1);
+
+	if (y - E.hl_lo <= HL_SYNC) {
+		while (E.hl_lo < y) {
+			u32 r = E.hl_lo;
+			hl_done(r, hl_lex(r, r ? hl_state(r - 1) : HS_NORMAL, NULL));
+		}
+		return hl_state(y - 1);
+	}
+
+	// Carry a synced run on down if that's closer than a new one
+	u8 state = HS_NORMAL;
+	u32 r = y - HL_SYNC;
+	if (E.hl_sync_hi > E.hl_sync_lo && E.hl_sync_hi < y && E.hl_sync_hi >= r) {
+		r = E.hl_sync_hi;
+		state = hl_state(r - 1);
+	} else E.hl_sync_lo = E.hl_sync_hi = r;
+	for (; r < y; r++) {
+		state = hl_lex(r, state, NULL);
+		hl_done(r, state);
+	}
+	return state;
+}
+
+/*
+ * Rendering
+ */
+static void draw_banner_row(struct abuf* ab, u32 y) {
+	if (y != E.screen_rows / 3) {
+		ab_append(ab, "~", 1);
+		return;
+	}
+
+	char msg[80];
+	u32 msg_len = snprintf(msg, sizeof(msg), "editor -- version %s", VERSION);
+	if (msg_len > E.screen_cols) msg_len = E.screen_cols;
+	u32 padding = (E.screen_cols - msg_len) / 2;
+	if (padding > 0) {
+		ab_append(ab, "~", 1);
+		padding--;
+	}
+	ab_pad(ab, ' ', padding);
+	ab_append(ab, msg, msg_len);
+}
+
+// Width of the line number column, the number and a space after it
+static u32 gutter_width(void) {
+	u32 digits = 4;
+	for (u32 n = E.row_count; n >= 10000; n /= 10) digits++;
+	return digits + 1;
+}
+
+static u32 text_cols(void) {
+	u32 gutter = gutter_width();
+	return E.screen_cols > gutter ? E.screen_cols - gutter : 0;
+}
+
+static void draw_color(struct abuf* ab, u8* cur, u8 hl) {
+	if (hl == *cur) return;
+	ab_append(ab, "\x1b[", 2);
+	ab_append(ab, HL_COLOR[hl], 2);
+	ab_append(ab, "m", 1);
+	*cur = hl;
+}
+
+// Tabs are expanded here, while drawing, so rows never carry a rendered
+// copy; only the columns from 'from' on that fit get emitted. Lines after
+// the first of a wrapped row leave the line number out. 'hl' is the class
+// of each byte up to HL_MAX_BYTES, or NULL to draw it all plain.
+static void draw_file_row(struct abuf* ab, u32 file_row, u32 from, bool first, const u8* hl) {
+	struct erow* row = row_at(file_row);
+	u32 hl_len = hl ? (row->len < HL_MAX_BYTES ? row->len : HL_MAX_BYTES) : 0;
+	u8 cur = HL_NORMAL;
+
+	char linenr[16];
+	if (first) ab_append(ab, linenr, snprintf(linenr, sizeof(linenr), "%*u ", gutter_width() - 1, file_row + 1));
+	else ab_pad(ab, ' ', gutter_width());
+
+	u32 end = from + text_cols();
+	const u8* s = (const u8*)row_chars(row);
+	u32 col, x = row_byte(file_row, from, &col);
+
+	// A tab or wide character cut by the left edge shows as blanks
+	if (x < row->len && col < from) {
+		u32 len, w = char_cols(s + x, row->len - x, col, &len);
+		ab_pad(ab, ' ', (col + w < end ? col + w : end) - from);
+		col += w;
+		x += len;
+	}
+
+	while (x < row->len && col < end) {
+		u8 h = x < hl_len ? hl[x] : HL_NORMAL;
+		draw_color(ab, &cur, h);
+
+		u32 run = 0, max = row->len - x;
+		if (max > end - col) max = end - col;
+		if (x < hl_len && max > hl_len - x) max = hl_len - x;
+		while (run < max && s[x + run] < 0x80 && s[x + run] != '\t' && (hl_len == 0 || hl[x + run] == h)) run++;
+		if (run) {
+			ab_append(ab, (const char*)s + x, run);
+			x += run;
+			col += run;
+			continue;
+		}
+
+		u32 cp, len = 1, w = TAB_SIZE - col % TAB_SIZE;
+		int cw = 0;
+		if (s[x] != '\t') {
+			len = utf8_decode(s + x, row->len - x, &cp);
+			cw = cp_cols(cp);
+			w = cw < 0 ? 1 : cw;
+		}
+		if (col + w > end) {
+			ab_pad(ab, ' ', end - col);
+			break;
+		}
+
+		if (s[x] == '\t') ab_pad(ab, ' ', w);
+		else if (cw < 0) ab_append(ab, "\xef\xbf\xbd", 3);
+		else ab_append(ab, (const char*)s + x, len);
+		col += w;
+		x += len;
+	}
+	draw_color(ab, &cur, HL_NORMAL);
+}
+
+// Send terminal line 'y' only if it differs from what is already shown
+// there. The line buffer is swapped into the shadow copy rather than copied.
+static void draw_line(struct abuf* ab, u32 y, struct abuf* line) {
+	struct abuf* shown = &E.shown[y];
+	if (shown->len == line->len && (line->len == 0 || memcmp(shown->b, line->b, line->len) == 0)) {
+		line->len = 0;
+		return;
+	}
+
+	char buf[32];
+	u32 len = snprintf(buf, sizeof(buf), "\x1b[%u;1H\x1b[K", y + 1);
+	ab_append(ab, buf, len);
+	ab_append(ab, line->b, line->len);
+
+	struct abuf tmp = *shown;
+	*shown = *line;
+	*line = tmp;
+	line->len = 0;
+}
+
+// Rows on screen are lexed in order to carry the state from one to the
+// next, except for trusted rows that needn't be redrawn. Lexing a row may
+// damage the ones below it, so the damage is checked as we go. A row that
+// changes height when wrapping moves everything under it, so then every
+// line gets drawn and draw_line() sorts out which ones really changed.
+static void draw_rows(struct abuf* ab, struct abuf* line) {
+	u8 state = E.syntax ? hl_start(E.row_offset) : HS_NORMAL;
+	u32 file_row = E.row_offset, sub = E.wrap ? E.row_sub : 0, height = 1;
+	u8* hl = NULL;
+	for (u32 y = 0; y < E.screen_rows; y++) {
+		bool damaged = E.wrap || (file_row >= E.damage_lo && file_row < E.damage_hi);
+
+		if (y == 0 || sub == 0) {
+			hl = NULL;
+			height = row_height(file_row);
+			if (E.syntax && file_row < E.row_count) {
+				if (!damaged && hl_trusted(file_row)) state = hl_state(file_row);
+				else {
+					if (damaged) {
+						E.hl_buf.len = 0;
+						ab_reserve(&E.hl_buf, HL_MAX_BYTES);
+						hl = (u8*)E.hl_buf.b;
+					}
+					state = hl_lex(file_row, state, hl);
+					hl_done(file_row, state);
+				}
+			}
+		}
+
+		if (damaged) {
+			if (E.row_count == 0) draw_banner_row(line, y);
+			else if (file_row >= E.row_count) ab_append(line, "~", 1);
+			else if (E.wrap) draw_file_row(line, file_row, wrap_col(file_row, sub), sub == 0, hl);
+			else draw_file_row(line, file_row, E.col_offset, true, hl);
+
+			draw_line(ab, y, line);
+		}
+
+		if (++sub >= height) {
+			file_row++;
+			sub = 0;
+		}
+	}
+}
+
+static void draw_statusbar(struct abuf* ab) {
+	ab_append(ab, "\x1b[7m", 4);
+	char lstatus[80], rstatus[80];
+
+	u32 llen = snprintf(lstatus, sizeof(lstatus), "%s %.20s %s%s%s", MODE_STR[E.mode], E.filename ? E.filename : "No file", E.dirty ? "[modified] " : "",
+		E.follow ? "[follow] " : E.view ? "[RO] " : "", E.partial ? "[partial]" : "");
+	if (E.index) llen += snprintf(lstatus + llen, sizeof(lstatus) - llen, "loading %u%%", index_progress());
+	u32 rlen = 0;
+	if (E.search && match_index_ready()) rlen = snprintf(rstatus, sizeof(rstatus), "[%u/%u] ", match_rank((pos_t){ E.cx, E.cy }, true), match_total());
+	else if (E.search) rlen = snprintf(rstatus, sizeof(rstatus), "[?/?] ");
+	rlen += snprintf(rstatus + rlen, sizeof(rstatus) - rlen, "%u:%u", E.cx + 1, E.cy + 1);
+
+	if (llen > E.screen_cols) llen = E.screen_cols;
+	ab_append(ab, lstatus, llen);
+
+	if (E.screen_cols - llen >= rlen) {
+		ab_pad(ab, ' ', E.screen_cols - llen - rlen);
+		ab_append(ab, rstatus, rlen);
+	} else ab_pad(ab, ' ', E.screen_cols - llen);
+
+	ab_append(ab, "\x1b[m", 3);
+}
+
+static void draw_statusmsg(struct abuf* ab) {
+	u32 msg_len = strlen(E.statusmsg);
+	if (msg_len > E.screen_cols) msg_len = E.screen_cols;
+	if (msg_len && (E.mode == M_COMMAND || time(NULL) - E.statusmsg_time < MSG_TIMEOUT)) ab_append(ab, E.statusmsg, msg_len);
+#ifdef PERF
+	else if (P.overlay) {
+		char buf[128];
+		u32 len = perf_status(buf, sizeof(buf));
+		ab_append(ab, buf, len < E.screen_cols ? len : E.screen_cols);
+	}
+#endif
+}
+
+static void reverse_lines(struct abuf* lines, u32 n) {
+	for (u32 i = 0; i < n / 2; i++) {
+		struct abuf tmp = lines[i];
+		lines[i] = lines[n - i - 1];
+		lines[n - i - 1] = tmp;
+	}
+}
+
+// Move what's on screen by the change in row_offset using a scroll region,
+// so only the lines that scroll into view have to be sent
+static void scroll_screen(struct abuf* ab) {
+	u32 rows = E.screen_rows;
+	pos_t top = { E.row_sub, E.row_offset }, shown = { E.shown_row_sub, E.shown_row_offset };
+	bool up = E.row_offset > E.shown_row_offset || (E.row_offset == E.shown_row_offset && E.row_sub > E.shown_row_sub);
+	u32 d = up ? E.row_offset - E.shown_row_offset : E.shown_row_offset - E.row_offset;
+	if (E.wrap) d = up ? vline_dist(shown, top, rows) : vline_dist(top, shown, rows);
+	if (d == 0) return;
+	if (d >= rows) {
+		damage_rows(0, UINT32_MAX);
+		return;
+	}
+
+	char buf[32];
+	u32 len = snprintf(buf, sizeof(buf), "\x1b[1;%ur\x1b[%u%c\x1b[r", rows, d, up ? 'S' : 'T');
+	ab_append(ab, buf, len);
+
+	// Rotate the shadow lines along with the terminal, the d lines that
+	// wrap around are the blank ones the terminal scrolled in
+	u32 split = up ? d : rows - d;
+	reverse_lines(E.shown, split);
+	reverse_lines(&E.shown[split], rows - split);
+	reverse_lines(E.shown, rows);
+
+	u32 blank = up ? rows - d : 0;
+	for (u32 y = blank; y < blank + d; y++) E.shown[y].len = 0;
+	damage_rows(E.row_offset + blank, E.row_offset + blank + d);
+}
+
+// Wrapped rows are only ever stepped through from the top of the screen
+// to the cursor or a screen's worth of lines back from it, so this costs
+// the same wherever in the file it happens
+static void scroll_wrap(u32 col) {
+	E.col_offset = 0;
+	u32 height = row_height(E.row_offset);
+	if (E.row_sub >= height) E.row_sub = height - 1;
+
+	pos_t cur = { wrap_line(E.cy, col), E.cy };
+	pos_t top = { E.row_sub, E.row_offset };
+	if (cur.y < top.y || (cur.y == top.y && cur.x < top.x)) top = cur;
+	else if (vline_dist(top, cur, E.screen_rows) >= E.screen_rows) top = vline_up(cur, E.screen_rows - 1);
+
+	E.row_offset = top.y;
+	E.row_sub = top.x;
+	E.ry = vline_dist(top, cur, E.screen_rows);
+	E.rx = col - wrap_col(cur.y, cur.x);
+}
+
+// Keep the cursor on screen and work out where on it it goes (E.rx, E.ry)
+static void scroll(void) {
+	u32 col = row_col(E.cy, E.cx);
+	if (E.wrap) {
+		scroll_wrap(col);
+		return;
+	}
+	u32 cols = text_cols();
 
+	// All of a wide character under the cursor has to fit on screen
+	u32 w = 1, len;
 	if (E.cy < E.row_count) {
-		E.rx = 0;
-		for (u32 i = 0; i < E.cx; i++) {
-			if (E.rows[E.cy].chars[i] == '\t') E.rx += (TAB_SIZE - 1) - (E.rx % TAB_SIZE);
-			E.rx++;
-		}
+		struct erow* row = row_at(E.cy);
+		if (E.cx < row->len) w = char_cols((const u8*)row_chars(row) + E.cx, row->len - E.cx, col, &len);
 	}
 
-	if (E.ry < E.row_offset) E.row_offset = E.ry;
-	if (E.ry >= E.row_offset + E.screen_rows) E.row_offset = E.ry - E.screen_rows + 1;
-	if (E.rx < E.col_offset) E.col_offset = E.rx;
-	if (E.rx >= E.col_offset + E.screen_cols) E.col_offset = E.rx - E.screen_cols + 1;
+	if (E.cy < E.row_offset) E.row_offset = E.cy;
+	if (E.cy >= E.row_offset + E.screen_rows) E.row_offset = E.cy - E.screen_rows + 1;
+	if (col < E.col_offset) E.col_offset = col;
+	if (col + w > E.col_offset + cols && col + w >= cols) E.col_offset = col + w - cols;
+	E.rx = col - E.col_offset;
+	E.ry = E.cy - E.row_offset;
+}
+
+// Forget what's on the terminal so the next frame repaints it from scratch
+static void screen_invalidate(void) {
+	for (u32 y = 0; y < E.shown_lines; y++) ab_free(&E.shown[y]);
+	free(E.shown);
+	E.shown = NULL;
+	E.shown_lines = 0;
 }
 
+// Only lines that were damaged by an edit, scrolled into view or whose
+// contents otherwise differ from the shadow copy get sent to the terminal.
+// The frame and line buffers are reset, never freed, between frames.
 static void refresh_screen(void) {
+	PERF_SCOPE(P_REFRESH);
 	scroll();
 
-	struct abuf ab = { 0 };
+	struct abuf* ab = &E.frame;
+	ab->len = 0;
+	E.line.len = 0;
+
+	ab_append(ab, "\x1b[?25l", 6);
 
-	ab_append(&ab, "\x1b[H", 3);
-	ab_append(&ab, "\x1b[?25l", 6);
+	u32 lines = E.screen_rows + 2;
+	if (E.shown_lines != lines) {
+		screen_invalidate();
+		E.shown = calloc(lines, sizeof(struct abuf));
+		if (E.shown == NULL) die("calloc");
+		E.shown_lines = lines;
 
-	draw_rows(&ab);
-	draw_statusbar(&ab);
-	draw_statusmsg(&ab);
+		ab_append(ab, "\x1b[2J", 4);
+		damage_rows(0, UINT32_MAX);
+	} else if (E.col_offset != E.shown_col_offset) {
+		damage_rows(0, UINT32_MAX);
+	} else scroll_screen(ab);
+
+	draw_rows(ab, &E.line);
+	draw_statusbar(&E.line);
+	draw_line(ab, E.screen_rows, &E.line);
+	draw_statusmsg(&E.line);
+	draw_line(ab, E.screen_rows + 1, &E.line);
+
+	E.shown_row_offset = E.row_offset;
+	E.shown_row_sub = E.row_sub;
+	E.shown_col_offset = E.col_offset;
+	E.damage_lo = E.damage_hi = 0;
 
 	char buf[32];
-	u32 len = snprintf(buf, sizeof(buf), "\x1b[%u;%uH", (E.ry - E.row_offset) + 1, E.rx + 6);
-	ab_append(&ab, buf, len);
+	u32 len = snprintf(buf, sizeof(buf), "\x1b[%u;%uH", E.ry + 1, E.rx + gutter_width() + 1);
+	ab_append(ab, buf, len);
 	
-	ab_append(&ab, "\x1b[?25h", 6);
-	write(STDOUT_FILENO, ab.b, ab.len);
-	ab_free(&ab);
+	ab_append(ab, "\x1b[?25h", 6);
+	write(STDOUT_FILENO, ab->b, ab->len);
+	perf_written(ab->len);
 }
 
 /*
@@ -528,33 +3996,42 @@ static void refresh_screen(void) {
 static pos_t fix_toofar(pos_t p) {
 	if (E.row_count == 0) { p.x = 0; p.y = 0; return p; }
 	if (p.y >= E.row_count) p.y = E.row_count - 1;
-	u32 len = E.rows[p.y].len;
+	u32 len = row_at(p.y)->len;
 	if (p.x > len) p.x = len;
 	return p;
 }
 
+// Moving up or down keeps the cursor in the same screen column
+static pos_t move_vertical(pos_t p, u32 y) {
+	u32 col = row_col(p.y, p.x), start;
+	p.y = y;
+	p = fix_toofar(p);
+	p.x = row_byte(p.y, col, &start);
+	return p;
+}
+
 static pos_t motion_up(pos_t p, u32 count) {
 	u32 dy = (count > p.y) ? p.y : count;
-	p.y -= dy;
-	return fix_toofar(p);
+	return move_vertical(p, p.y - dy);
 }
 
 static pos_t motion_down(pos_t p, u32 count) {
+	index_wait(p.y + count);
 	u32 dy = (p.y + count > E.row_count) ? E.row_count - p.y : count;
-	p.y += dy;
-	return fix_toofar(p);
+	return move_vertical(p, p.y + dy);
 }
 
 static pos_t motion_left(pos_t p, u32 count) {
-	u32 dx = (count > p.x) ? p.x : count;
-	p.x -= dx;
+	if (p.y >= E.row_count) return p;
+	struct erow* row = row_at(p.y);
+	while (count-- && p.x > 0) p.x = char_prev(row, p.x);
 	return p;
 }
 
 static pos_t motion_right(pos_t p, u32 count) {
-	u32 len = (p.y >= E.row_count) ? 0 : E.rows[p.y].len;
-	u32 dx = (p.x + count > len) ? len - p.x : count;
-	p.x += dx;
+	if (p.y >= E.row_count) return p;
+	struct erow* row = row_at(p.y);
+	while (count-- && p.x < row->len) p.x = char_next(row, p.x);
 	return p;
 }
 
@@ -564,15 +4041,15 @@ static pos_t motion_home(pos_t p, u32 count) {
 }
 
 static pos_t motion_end(pos_t p, u32 count) {
-	struct erow* row = (p.y >= E.row_count) ? NULL : &E.rows[p.y];
-	p.x = row ? row->len : 0;
-	return motion_down(p, count - 1);
+	p = motion_down(p, count - 1);
+	p.x = (p.y >= E.row_count) ? 0 : row_at(p.y)->len;
+	return p;
 }
 
 static pos_t motion_file_top(pos_t p, u32 count) {
 	(void)count;
 	p.y = 0;
-	struct erow* row = (p.y >= E.row_count) ? NULL : &E.rows[p.y];
+	struct erow* row = (p.y >= E.row_count) ? NULL : row_at(p.y);
 	u32 len = row ? row->len : 0;
 	if (p.x > len) p.x = len;
 	return fix_toofar(p);
@@ -580,96 +4057,121 @@ static pos_t motion_file_top(pos_t p, u32 count) {
 
 static pos_t motion_file_bottom(pos_t p, u32 count) {
 	(void)count;
+	index_wait(UINT32_MAX);
 	p.y = E.row_count ? E.row_count - 1 : 0;
-	struct erow* row = (p.y >= E.row_count) ? NULL : &E.rows[p.y];
+	struct erow* row = (p.y >= E.row_count) ? NULL : row_at(p.y);
 	u32 len = row ? row->len : 0;
 	if (p.x > len) p.x = len;
 	return fix_toofar(p);
 }
 
-static inline bool iswordchar(u8 c) { return isalnum(c) || c == '_'; }
-
-static pos_t fword_impl(pos_t p, bool big) {
-	char c = get_char_at(p);
-
-	if (!big && !iswordchar(c)) {
-		p.x++;
-		c = get_char_at(p);
-	}
-
-	if (big ? !isspace((u8)c) : iswordchar((u8)c)) {
-		do {
-			p.x++;
-			c = get_char_at(p);
-			if (c == '\n') { p.x = 0; p.y++; c = get_char_at(p); }
-		} while (c != '\0' && (big ? !isspace((u8)c) : iswordchar((u8)c)));
-	}
-
-	while (isspace((u8)c)) {
-		p.x++;
-		c = get_char_at(p);
-		if (c == '\n') { p.x = 0; p.y++; c = get_char_at(p); }
+// Both scanners walk the row bytes directly and only look a row up when
+// they step onto it, doing all 'count' words in one go. An empty line
+// counts as a word of its own.
+static pos_t fword_scan(pos_t p, u32 count, bool big) {
+	if (p.y >= E.row_count) return fix_toofar(p);
+	struct erow* row = row_at(p.y);
+	u8* s = (u8*)row_chars(row);
+	u32 x = p.x, y = p.y, len = row->len;
+
+	while (count--) {
+		// For W anything that isn't blank is part of the word
+		u8 k = x < len ? char_class[s[x]] : CC_BLANK;
+		if (k != CC_BLANK && big) while (x < len && char_class[s[x]] != CC_BLANK) x++;
+		else if (k != CC_BLANK) while (x < len && char_class[s[x]] == k) x++;
+
+		while (1) {
+			while (x < len && char_class[s[x]] == CC_BLANK) x++;
+			if (x < len) break;
+
+			if (y + 1 >= E.row_count) index_wait(y + 1);
+			if (y + 1 >= E.row_count) return (pos_t){ len, y };
+			row = row_at(++y);
+			s = (u8*)row_chars(row);
+			len = row->len;
+			x = 0;
+			if (len == 0) break;
+		}
 	}
-
-	return fix_toofar(p);
+	return (pos_t){ x, y };
 }
 
-static pos_t bword_impl(pos_t p, bool big) {
-	if (p.x == 0) {
-		if (p.y == 0) return p;
-		p.y--;
-		p.x = E.rows[p.y].len;
-	} else {
-		p.x--;
-	}
-
-	char c = get_char_at(p);
-
-	while (isspace((u8)c)) {
-		if (p.x == 0) {
-			if (p.y == 0) return fix_toofar(p);
-			p.y--;
-			p.x = E.rows[p.y].len;
-		} else {
-			p.x--;
+static pos_t bword_scan(pos_t p, u32 count, bool big) {
+	if (p.y >= E.row_count) return fix_toofar(p);
+	struct erow* row = row_at(p.y);
+	u8* s = (u8*)row_chars(row);
+	u32 x = p.x, y = p.y;
+	if (x > row->len) x = row->len;
+
+	while (count--) {
+		while (1) {
+			while (x > 0 && char_class[s[x - 1]] == CC_BLANK) x--;
+			if (x > 0) break;
+
+			if (y == 0) return (pos_t){ 0, 0 };
+			row = row_at(--y);
+			s = (u8*)row_chars(row);
+			x = row->len;
+			if (x == 0) break;
 		}
-		c = get_char_at(p);
-	}
 
-	if (big ? !isspace((u8)c) : iswordchar((u8)c)) {
-		while (p.x > 0 && (big ? !isspace((u8)get_char_at((pos_t){p.x - 1, p.y}))
-		                       : iswordchar((u8)get_char_at((pos_t){p.x - 1, p.y})))) {
-			p.x--;
-		}
-	} else {
-		while (p.x > 0) {
-			char pc = get_char_at((pos_t){p.x - 1, p.y});
-			if (isspace((u8)pc) || (big ? false : iswordchar((u8)pc))) break;
-			p.x--;
-		}
+		u8 k = x > 0 ? char_class[s[x - 1]] : CC_BLANK;
+		if (k != CC_BLANK && big) while (x > 0 && char_class[s[x - 1]] != CC_BLANK) x--;
+		else if (k != CC_BLANK) while (x > 0 && char_class[s[x - 1]] == k) x--;
 	}
-
-	return fix_toofar(p);
+	return (pos_t){ x, y };
 }
 
 static pos_t motion_fword(pos_t p, u32 count) {
-	for (u32 i = 0; i < count; i++) p = fword_impl(p, false);
-	return p;
+	return fword_scan(p, count, false);
 }
 
 static pos_t motion_bword(pos_t p, u32 count) {
-	for (u32 i = 0; i < count; i++) p = bword_impl(p, false);
-	return p;
+	return bword_scan(p, count, false);
 }
 
 static pos_t motion_fWORD(pos_t p, u32 count) {
-	for (u32 i = 0; i < count; i++) p = fword_impl(p, true);
-	return p;
+	return fword_scan(p, count, true);
 }
 
 static pos_t motion_bWORD(pos_t p, u32 count) {
-	for (u32 i = 0; i < count; i++) p = bword_impl(p, true);
-	return p;
+	return bword_scan(p, count, true);
+}
+
+// Paragraphs are separated by empty rows. Skip the ones we're on, then go
+// to the next one; past the last paragraph is the end of the buffer.
+static pos_t motion_paragraph_fwd(pos_t p, u32 count) {
+	if (E.row_count == 0) return p;
+	u32 y = p.y;
+	while (count--) {
+		y = blank_next(blank_next(y, false), true);
+		if (y >= E.row_count) return (pos_t){ row_at(E.row_count - 1)->len, E.row_count - 1 };
+	}
+	return (pos_t){ 0, y };
+}
+
+static pos_t motion_paragraph_back(pos_t p, u32 count) {
+	if (E.row_count == 0) return p;
+	u32 y = p.y;
+	while (count--) {
+		u32 text = blank_prev(y, false);
+		y = text == UINT32_MAX ? UINT32_MAX : blank_prev(text, true);
+		if (y == UINT32_MAX) return (pos_t){ 0, 0 };
+	}
+	return (pos_t){ 0, y };
+}
+
+static pos_t motion_search(pos_t p, u32 count) {
+	return search_prompt(false) ? search_next(p, count, false) : p;
+}
+static pos_t motion_search_back(pos_t p, u32 count) {
+	return search_prompt(true) ? search_next(p, count, true) : p;
+}
+static pos_t motion_search_next(pos_t p, u32 count) {
+	return search_next(p, count, E.search_back);
+}
+static pos_t motion_search_prev(pos_t p, u32 count) {
+	return search_next(p, count, !E.search_back);
 }
 
 static void motions_init(void) {
@@ -679,8 +4181,11 @@ static void motions_init(void) {
 	// TODO: The ones that are being set to NULL
 	motions['\n'] = NULL;
 	motions['$'] = motion_end;
+	motions['/'] = motion_search;
+	motions['?'] = motion_search_back;
 	motions['B'] = motion_bWORD;
 	motions['G'] = motion_file_bottom;
+	motions['N'] = motion_search_prev;
 	motions['W'] = motion_fWORD;
 	motions['_'] = motion_home;
 	motions['b'] = motion_bword;
@@ -689,13 +4194,20 @@ static void motions_init(void) {
 	motions['j'] = motion_down;
 	motions['k'] = motion_up;
 	motions['l'] = motion_right;
+	motions['n'] = motion_search_next;
 	motions['w'] = motion_fword;
-	motions['{'] = NULL;
-	motions['}'] = NULL;
+	motions['{'] = motion_paragraph_back;
+	motions['}'] = motion_paragraph_fwd;
+
+	motion_flags['G'] = MF_LINEWISE;
+	motion_flags['_'] = MF_LINEWISE;
+	motion_flags['g'] = MF_LINEWISE;
+	motion_flags['j'] = MF_LINEWISE;
+	motion_flags['k'] = MF_LINEWISE;
 }
 
 static pos_t run_motion(int key, pos_t start, u32 count) {
-	if ((u32)key < sizeof(motions)) {
+	if ((u32)key < sizeof(motions) / sizeof(*motions)) {
 		motion_fn motion = motions[key];
 		if (motion) return motion(start, count);
 	}
@@ -704,10 +4216,390 @@ static pos_t run_motion(int key, pos_t start, u32 count) {
 	return start;
 }
 
-// TODO:
-static void change_range(pos_t start, pos_t end) {}
-static void delete_range(pos_t start, pos_t end) {}
-static void yank_range(pos_t start, pos_t end) {}
+// Put a range in order and clamp it to the buffer. Like vi, a characterwise
+// range that ends at the start of a line stops at the end of the one before,
+// or takes whole lines if it also starts before the first non-blank.
+static bool range_fix(pos_t* start, pos_t* end, bool* linewise) {
+	if (E.row_count == 0) return false;
+	if (end->y < start->y || (end->y == start->y && end->x < start->x)) {
+		pos_t t = *start;
+		*start = *end;
+		*end = t;
+	}
+
+	if (end->y >= E.row_count) {
+		end->y = E.row_count - 1;
+		end->x = row_at(end->y)->len;
+	}
+	if (start->y >= E.row_count) return false;
+	if (!*linewise && end->x == 0 && end->y > start->y) {
+		end->y--;
+		end->x = row_at(end->y)->len;
+
+		struct erow* row = row_at(start->y);
+		u32 x = 0;
+		while (x < start->x && isspace((u8)row_chars(row)[x])) x++;
+		if (x == start->x) *linewise = true;
+	}
+	return *linewise || start->y != end->y || start->x != end->x;
+}
+
+// Cut a range that has been through range_fix() into the register
+static void range_cut(pos_t start, pos_t end, bool linewise) {
+	reg_yank(&E.reg, start, end, linewise);
+
+	if (linewise) {
+		row_delete_rows(start.y, end.y - start.y + 1);
+		E.cx = 0;
+		E.cy = start.y;
+		return;
+	}
+
+	if (start.y == end.y) row_delete_string(start.y, start.x, end.x - start.x);
+	else {
+		struct erow* last = row_at(end.y);
+		row_truncate(start.y, start.x);
+		if (end.x < last->len) row_append_string(start.y, &row_chars(last)[end.x], last->len - end.x);
+		row_delete_rows(start.y + 1, end.y - start.y);
+	}
+	E.cx = start.x;
+	E.cy = start.y;
+}
+
+static void delete_range(pos_t start, pos_t end, bool linewise) {
+	if (range_fix(&start, &end, &linewise)) range_cut(start, end, linewise);
+}
+
+static void change_range(pos_t start, pos_t end, bool linewise) {
+	if (range_fix(&start, &end, &linewise)) {
+		range_cut(start, end, linewise);
+		if (linewise) row_insert(start.y, "", 0);
+	}
+	E.mode = M_INSERT;
+}
+
+static void yank_range(pos_t start, pos_t end, bool linewise) {
+	if (!range_fix(&start, &end, &linewise)) return;
+	reg_yank(&E.reg, start, end, linewise);
+	if (linewise && end.y > start.y) statusmsg_set("%u lines yanked", end.y - start.y + 1);
+	E.cx = linewise ? E.cx : start.x;
+	E.cy = start.y;
+}
+
+// 'p' and 'P': lines go below or above the cursor row, text after or before
+// the cursor
+static void put_register(bool before) {
+	struct reg* r = &E.reg;
+	if (r->count == 0) return;
+
+	if (r->linewise) {
+		u32 at = (before || E.row_count == 0) ? E.cy : E.cy + 1;
+		if (at > E.row_count) at = E.row_count;
+		for (u32 i = 0; i < r->count; i++) row_insert(at + i, span_chars(r, &r->spans[i]), r->spans[i].len);
+		E.cx = 0;
+		E.cy = at;
+		return;
+	}
+
+	if (E.row_count == 0) row_insert(0, "", 0);
+	if (E.cy >= E.row_count) E.cy = E.row_count - 1;
+	struct erow* row = row_at(E.cy);
+	u32 x = (E.cx > row->len) ? row->len : E.cx;
+	if (!before && x < row->len) x++;
+
+	struct span* first = &r->spans[0];
+	if (r->count == 1) {
+		row_insert_string(E.cy, x, span_chars(r, first), first->len);
+		E.cx = first->len ? x + first->len - 1 : x;
+		return;
+	}
+
+	// Split the row at x and put the pieces in between its halves. The
+	// insert may move the row, so only look at its tail afterwards.
+	struct span* last = &r->spans[r->count - 1];
+	u32 tail_len = row->len - x;
+	row_insert(E.cy + 1, span_chars(r, last), last->len);
+	row_append_string(E.cy + 1, &row_chars(row_at(E.cy))[x], tail_len);
+	row_truncate(E.cy, x);
+	row_append_string(E.cy, span_chars(r, first), first->len);
+	for (u32 i = 1; i + 1 < r->count; i++) row_insert(E.cy + i, span_chars(r, &r->spans[i]), r->spans[i].len);
+	E.cx = x;
+}
+
+/*
+ * Filters
+ *
+ * :N,M!cmd runs rows N..M through cmd and puts its output in their place,
+ * :r !cmd puts cmd's output below the cursor. The rows are written to the
+ * child straight from their storage while its output is read back and
+ * inserted after them as it comes, so nothing holds the whole range, and
+ * with both pipes non-blocking neither side can stall the other. Runs of
+ * lines the mapping still holds as they are get vmsplice()d into the pipe.
+ */
+struct feed {
+	u32 y, end;		// Rows [y, end) are still to go
+	u32 off;		// Bytes of row y (and its '\n') already sent
+	char* run, * run_end;	// What's left of a mapped run being sent
+};
+
+// The block starting at row y, if all of it lies before 'end' and its
+// lines can go as the mapping has them, see write_rows()
+static struct rblock* feed_run(u32 y, u32 end) {
+	u32 first;
+	struct rblock* blk = E.blocks[block_find(y, &first)];
+	if (y != first || !blk->lazy || first + blk->count > end) return NULL;
+	if (blk->lazy_end[-1] != '\n' || memchr(blk->lazy, '\r', blk->lazy_end - blk->lazy)) return NULL;
+	return blk;
+}
+
+// Send what the pipe takes. False once everything is out, or the child
+// stopped reading.
+static bool feed_rows(int fd, struct feed* f) {
+	while (1) {
+		if (!f->run && f->off == 0 && f->y < f->end) {
+			struct rblock* blk = feed_run(f->y, f->end);
+			if (blk) {
+				f->run = blk->lazy;
+				f->run_end = blk->lazy_end;
+				f->y += blk->count;
+			}
+		}
+
+		ssize_t n;
+		if (f->run) {
+			struct iovec iov = { f->run, f->run_end - f->run };
+			n = vmsplice(fd, &iov, 1, SPLICE_F_NONBLOCK);
+			if (n == -1 && errno == EINVAL) n = write(fd, f->run, f->run_end - f->run);
+			if (n > 0 && (f->run += n) == f->run_end) f->run = NULL;
+		} else {
+			// Rows are only looked at right before the write, any insert
+			// after that may move the inline ones
+			struct iovec iov[SAVE_IOVS];
+			u32 k = 0;
+			for (u32 y = f->y; y < f->end && k < SAVE_IOVS - 1; y++) {
+				if (y > f->y && feed_run(y, f->end)) break;
+				struct erow* row = row_at(y);
+				u32 skip = (y == f->y) ? f->off : 0;
+				if (skip < row->len) iov[k++] = (struct iovec){ row_chars(row) + skip, row->len - skip };
+				iov[k++] = (struct iovec){ "\n", 1 };
+			}
+			if (k == 0) return false;
+
+			n = writev(fd, iov, k);
+			for (ssize_t left = n; left > 0; ) {
+				u32 rest = row_at(f->y)->len + 1 - f->off;
+				if ((u64)left < rest) {
+					f->off += left;
+					break;
+				}
+				left -= rest;
+				f->off = 0;
+				f->y++;
+			}
+		}
+
+		if (n == -1) return errno == EAGAIN || errno == EINTR;
+	}
+}
+
+// Put the lines that came in as rows from *at on, keeping a last partial
+// one in buf for later
+static void filter_take(struct abuf* buf, u32* at, bool eof) {
+	if (eof && buf->len > 0 && buf->b[buf->len - 1] != '\n') ab_append(buf, "\n", 1);
+	char* nl = memrchr(buf->b, '\n', buf->len);
+	if (nl == NULL) return;
+
+	u32 len = nl - buf->b;
+	*at += row_insert_rows(*at, buf->b, len);
+	memmove(buf->b, nl + 1, buf->len - len - 1);
+	buf->len -= len + 1;
+}
+
+// Whether ^C came in, any other keys are kept for later
+static bool filter_cancelled(void) {
+	u32 from = E.in_tail;
+	input_fill(0);
+	for (u32 i = from; i != E.in_tail; i++) {
+		if (E.inbuf[i & (INBUF_SIZE - 1)] != CTRL_KEY('c')) continue;
+		input_drop(i);
+		return true;
+	}
+	return false;
+}
+
+// Feed rows [lo, hi) to cmd and put its output at 'at', and then drop the
+// rows. ^C stops cmd and leaves the rows as they were.
+static void filter(const char* cmd, u32 lo, u32 hi, u32 at) {
+	if (E.view) {
+		statusmsg_set("Buffer is read-only");
+		return;
+	}
+
+	int in[2], out[2];
+	if (pipe2(in, O_CLOEXEC) == -1) {
+		statusmsg_set("%s", strerror(errno));
+		return;
+	}
+	if (pipe2(out, O_CLOEXEC) == -1) {
+		statusmsg_set("%s", strerror(errno));
+		close(in[0]);
+		close(in[1]);
+		return;
+	}
+	fcntl(in[1], F_SETPIPE_SZ, FILTER_PIPE);
+	fcntl(out[0], F_SETPIPE_SZ, FILTER_PIPE);
+
+	// A child that goes away early shouldn't take us with it
+	struct sigaction ign = { .sa_handler = SIG_IGN }, old;
+	sigemptyset(&ign.sa_mask);
+	sigaction(SIGPIPE, &ign, &old);
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		sigaction(SIGPIPE, &old, NULL);
+		setpgid(0, 0);
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		dup2(out[1], STDERR_FILENO);
+		execl("/bin/sh", "sh", "-c", cmd, (char*)NULL);
+		_exit(127);
+	}
+	int err = errno;
+	if (pid > 0) setpgid(pid, pid);
+	close(in[0]);
+	close(out[1]);
+	if (pid == -1) {
+		statusmsg_set("fork: %s", strerror(err));
+		close(in[1]);
+		close(out[0]);
+		sigaction(SIGPIPE, &old, NULL);
+		return;
+	}
+
+	fcntl(in[1], F_SETFL, O_NONBLOCK);
+	fcntl(out[0], F_SETFL, O_NONBLOCK);
+	if (lo == hi) {
+		close(in[1]);
+		in[1] = -1;
+	}
+
+	// The output only goes in the journal once it's all there, so ^C
+	// leaves neither an undo step nor a modified buffer behind
+	struct feed f = { .y = lo, .end = hi };
+	struct abuf buf = { 0 };
+	u32 y = at;
+	bool stopped = false, dirty = E.dirty;
+	E.undoing = true;
+	while (out[0] != -1) {
+		bool keys = E.in_tail - E.in_head < INBUF_SIZE;
+		struct pollfd pfd[3] = {
+			{ .fd = out[0], .events = POLLIN },
+			{ .fd = in[1], .events = POLLOUT },
+			{ .fd = keys ? STDIN_FILENO : -1, .events = POLLIN },
+		};
+		if (poll(pfd, 3, -1) == -1) {
+			if (errno == EINTR) continue;
+			die("poll");
+		}
+
+		if (pfd[1].revents && !feed_rows(in[1], &f)) {
+			close(in[1]);
+			in[1] = -1;
+		}
+		if (pfd[0].revents) {
+			ab_reserve(&buf, FILTER_READ);
+			ssize_t n = read(out[0], buf.b + buf.len, FILTER_READ);
+			if (n > 0) {
+				buf.len += n;
+				filter_take(&buf, &y, false);
+			} else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+				close(out[0]);
+				out[0] = -1;
+			}
+		}
+		// A second ^C doesn't ask
+		if ((pfd[2].revents & POLLIN) && filter_cancelled()) {
+			int sig = stopped ? SIGKILL : SIGTERM;
+			if (kill(-pid, sig) == -1) kill(pid, sig);
+			stopped = true;
+		}
+	}
+
+	if (in[1] != -1) close(in[1]);
+	int status;
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+	sigaction(SIGPIPE, &old, NULL);
+	filter_take(&buf, &y, true);
+	ab_free(&buf);
+
+	if (stopped) {
+		row_delete_rows(at, y - at);
+		E.undoing = false;
+		E.dirty = dirty;
+		statusmsg_set("Filter stopped");
+		return;
+	}
+
+	E.undoing = false;
+	for (u32 r = at; r < y; r++) {
+		struct erow* row = row_at(r);
+		if (r == at) undo_record(U_ROWS_INSERT, at, 0, row_chars(row), row->len);
+		else {
+			undo_extend("\n", 1);
+			undo_extend(row_chars(row), row->len);
+		}
+	}
+
+	row_delete_rows(lo, hi - lo);
+	E.cy = (at == hi) ? lo : at;
+	E.cx = 0;
+	if (WIFEXITED(status) && WEXITSTATUS(status) != 0) statusmsg_set("shell returned %d", WEXITSTATUS(status));
+	else if (hi > lo) statusmsg_set("%u lines filtered", hi - lo);
+}
+
+// A line address: N, '.' for the cursor's line or '$' for the last one,
+// taken as 1-based with '$' as UINT32_MAX
+static bool parse_addr(char** s, u32* y) {
+	if (**s == '.' || **s == '$') *y = (*(*s)++ == '.') ? E.cy + 1 : UINT32_MAX;
+	else if (isdigit((u8)**s)) *y = strtoul(*s, s, 10);
+	else return false;
+	return true;
+}
+
+// "%" or ADDR[,ADDR]
+static bool parse_range(char** s, u32* lo, u32* hi) {
+	if (**s == '%') {
+		(*s)++;
+		*lo = 1;
+		*hi = UINT32_MAX;
+		return true;
+	}
+	if (!parse_addr(s, lo)) return false;
+	*hi = *lo;
+	if (**s == ',') {
+		(*s)++;
+		if (!parse_addr(s, hi)) return false;
+	}
+	return true;
+}
+
+// :N,M!cmd
+static void filter_range(u32 lo, u32 hi, const char* cmd) {
+	if (*cmd == '\0') {
+		statusmsg_set("Usage: N,M!cmd");
+		return;
+	}
+	if (lo > hi) {
+		u32 t = lo;
+		lo = hi;
+		hi = t;
+	}
+	index_wait(hi > 0 ? hi - 1 : 0);
+	if (lo > 0) lo--;
+	if (lo > E.row_count) lo = E.row_count;
+	if (hi > E.row_count) hi = E.row_count;
+	filter(cmd, lo, hi, hi);
+}
 
 /*
  * Input handling
@@ -754,6 +4646,14 @@ static void eval_command(char* cmd) {
 	u32 len = strlen(cmd);
 	while (len > 0 && isspace(cmd[len - 1])) cmd[--len] = '\0';
 	if (*cmd == '\0') return;
+
+	// :N,M!cmd (or :%!cmd) filters rows through cmd
+	char* p = cmd;
+	u32 lo, hi;
+	if (parse_range(&p, &lo, &hi) && *p == '!') {
+		filter_range(lo, hi, p + 1);
+		return;
+	}
 	
 	char* arg = strchr(cmd, ' ');
 	if (arg) {
@@ -762,30 +4662,93 @@ static void eval_command(char* cmd) {
 		if (*arg == '\0') arg = NULL;
 	}
 
-	if (strcmp(cmd, "q") == 0) {
+	if (isdigit((u8)*cmd) && strspn(cmd, "0123456789") == len) {
+		// :N jumps to line N
+		u32 y = strtoul(cmd, NULL, 10);
+		index_wait(y ? y - 1 : 0);
+		E.cy = (y == 0) ? 0 : (y > E.row_count) ? E.row_count - (E.row_count > 0) : y - 1;
+		E.cx = 0;
+	} else if (strcmp(cmd, "q") == 0) {
 		if (E.dirty) statusmsg_set("No write since last change");
-		else exit(0);
+		else if (!buffer_unsaved()) exit(0);
 	} else if (strcmp(cmd, "q!") == 0) {
 		exit(0);
 	} else if (strcmp(cmd, "w") == 0) {
-		save_file(arg);
-	} else if (strcmp(cmd, "w!") == 0) { // TODO: Make this do something
-		save_file(arg);
-		statusmsg_set("");
+		save_file(arg, false);
+	} else if (strcmp(cmd, "w!") == 0) {
+		save_file(arg, true);
 	} else if (strcmp(cmd, "wq") == 0) {
-		save_file(arg);
-		exit(0);
-	} else if (strcmp(cmd, "e") == 0) {
-		if (E.dirty) statusmsg_set("No write since last change");
-		else open_file(arg);
-	} else if (strcmp(cmd, "e!") == 0) {
-		open_file(arg);
+		if (save_file(arg, false) && !buffer_unsaved()) exit(0);
+	} else if (strcmp(cmd, "e") == 0 || strcmp(cmd, "e!") == 0) {
+		if (arg) buffer_edit(arg, false);
+		else if (E.dirty && cmd[1] != '!') statusmsg_set("No write since last change");
+		else open_file(NULL);
+	} else if (strcmp(cmd, "view") == 0) {
+		if (arg) buffer_edit(arg, true);
+		else if (E.dirty) statusmsg_set("No write since last change");
+		else if (!E.view) {
+			E.view = true;
+			buffer_reload();
+		}
+	} else if (strcmp(cmd, "bn") == 0 || strcmp(cmd, "bp") == 0) {
+		buffer_switch((B.cur + (cmd[1] == 'n' ? 1 : B.count - 1)) % B.count);
+	} else if (strcmp(cmd, "b") == 0) {
+		u32 id = arg ? strtoul(arg, NULL, 10) : 0;
+		u32 k = 0;
+		while (k < B.count && B.list[k].id != id) k++;
+		if (k < B.count) buffer_switch(k);
+		else statusmsg_set("No buffer %s", arg ? arg : "");
+	} else if (strcmp(cmd, "ls") == 0) {
+		buffer_list();
+	} else if (strcmp(cmd, "r") == 0) {
+		if (arg && arg[0] == '!' && arg[1]) filter(arg + 1, 0, 0, E.row_count ? E.cy + 1 : 0);
+		else statusmsg_set("Usage: r !cmd");
+	} else if (strcmp(cmd, "perf") == 0) {
+#ifdef PERF
+		P.overlay = !P.overlay;
+		statusmsg_set("");
+#else
+		statusmsg_set("Built without instrumentation (see 'make perf')");
+#endif
+	} else if (strcmp(cmd, "set") == 0) {
+		if (arg && (strcmp(arg, "wrap") == 0 || strcmp(arg, "nowrap") == 0)) {
+			E.wrap = arg[0] == 'w';
+			E.row_sub = 0;
+			E.col_offset = 0;
+			damage_rows(0, UINT32_MAX);
+		} else if (arg && strcmp(arg, "follow") == 0) {
+			if (!E.view || !E.map) statusmsg_set("Only read-only files can be followed (see :view)");
+			else if (!E.follow) {
+				E.follow = true;
+				follow_watch();
+				follow_update();
+			}
+		} else if (arg && strcmp(arg, "nofollow") == 0) {
+			if (E.watch != -1) close(E.watch);
+			E.watch = -1;
+			E.follow = false;
+		} else statusmsg_set("Unknown option: %s", arg ? arg : "");
+	} else if (strcmp(cmd, "match") == 0) {
+		u32 n = arg ? strtoul(arg, NULL, 10) : 0;
+		if (E.search == NULL) statusmsg_set("No previous pattern");
+		else if (n == 0) statusmsg_set("Usage: match N");
+		else {
+			match_start();
+			match_wait(false);
+			if (!match_index_ready()) statusmsg_set("Could not count matches");
+			else if (n > match_total()) statusmsg_set("Only %u matches", match_total());
+			else {
+				pos_t p = match_pos(n - 1);
+				E.cx = p.x;
+				E.cy = p.y;
+			}
+		}
 	} else statusmsg_set("'%s' is not implemented", cmd);
 }
 
 static void insert_char(u32 c) {
 	if (E.cy == E.row_count) row_insert(E.row_count, "", 0);
-	row_insert_char(&E.rows[E.cy], E.cx, c);
+	row_insert_char(E.cy, E.cx, c);
 	E.cx++;
 }
 
@@ -794,33 +4757,95 @@ static void insert_newline(void) {
 
 	if (E.cx == 0) row_insert(E.cy, "", 0);
 	else {
-		struct erow* row = &E.rows[E.cy];
-		row_insert(E.cy + 1, &row->chars[E.cx], row->len - E.cx);
-		row = &E.rows[E.cy];
-		row->len = E.cx;
-		row->chars[row->len] = '\0';
-		row_update(row);
+		struct erow* row = row_at(E.cy);
+		row_insert(E.cy + 1, &row_chars(row)[E.cx], row->len - E.cx);
+		row_truncate(E.cy, E.cx);
 	}
 	E.cy++;
 	E.cx = 0;
 }
 
+// Insert a run of text at the cursor in one go, splitting it into rows at
+// newlines. Pastes usually come in with \r (or \r\n) line endings.
+static void insert_text(char* s, u32 len) {
+	char* end = s + len;
+	while (s < end) {
+		char* p = s;
+		while (p < end && (!iscntrl((u8)*p) || *p == '\t')) p++;
+
+		if (p > s) {
+			if (E.cy == E.row_count) row_insert(E.row_count, "", 0);
+			row_insert_string(E.cy, E.cx, s, p - s);
+			E.cx += p - s;
+		}
+		if (p == end) break;
+
+		if (*p == '\r' || *p == '\n') insert_newline();
+		if (*p == '\r' && p + 1 < end && p[1] == '\n') p++;
+		s = p + 1;
+	}
+}
+
+// Collect everything up to the closing \x1b[201~ and insert it as a whole
+static void read_paste(void) {
+	static const char closing[] = "\x1b[201~";
+	struct abuf paste = { 0 };
+	char c;
+
+	while (input_peek(0, &c, PASTE_TIMEOUT)) {
+		input_consume(1);
+		ab_append(&paste, &c, 1);
+		u32 n = sizeof(closing) - 1;
+		if (paste.len >= n && memcmp(&paste.b[paste.len - n], closing, n) == 0) {
+			paste.len -= n;
+			break;
+		}
+	}
+
+	if (E.view) statusmsg_set("Buffer is read-only");
+	else insert_text(paste.b, paste.len);
+	ab_free(&paste);
+}
+
 static void delete_char(void) {
 	if (E.cy >= E.row_count || (E.cx == 0 && E.cy == 0)) return;
 
-	struct erow* row = &E.rows[E.cy];
+	struct erow* row = row_at(E.cy);
 	if (E.cx > 0) {
-		row_delete_char(row, E.cx - 1);
-		E.cx--;
+		u32 x = char_prev(row, E.cx);
+		row_delete_string(E.cy, x, E.cx - x);
+		E.cx = x;
 	} else {
-		E.cx = E.rows[E.cy - 1].len;
-		row_append_string(&E.rows[E.cy - 1], row->chars, row->len);
+		E.cx = row_at(E.cy - 1)->len;
+		row_append_string(E.cy - 1, row_chars(row), row->len);
 		row_delete(E.cy);
 		E.cy--;
 	}
 }
 
+// 'x' and 'X' take out up to 'count' characters of the row after (or
+// before) the cursor as one span. With none on that side they fall back to
+// delete_char(), which joins the row to the one above.
+static void delete_chars(bool back) {
+	u32 count = E.pending_count ? E.pending_count : 1;
+	E.pending_count = 0;
+	E.pending_op = OP_NONE;
+	if (E.cy >= E.row_count) return;
+
+	pos_t cur = { E.cx, E.cy };
+	pos_t p = back ? motion_left(cur, count) : motion_right(cur, count);
+	if (p.x == cur.x) {
+		delete_char();
+		return;
+	}
+
+	u32 lo = back ? p.x : cur.x, hi = back ? cur.x : p.x;
+	row_delete_string(E.cy, lo, hi - lo);
+	E.cx = lo;
+}
+
 static void process_normal(u32 c) {
+	u8 op = OP_NONE;
 	if (isdigit((u8)c)) {
 		u32 digit = c - '0';
 		if (E.pending_count == 0 && digit == 0) goto handle_as_motion;
@@ -829,22 +4854,51 @@ static void process_normal(u32 c) {
 		return;
 	}
 
-	if (c == 'c') { E.pending_op = OP_CHANGE; return; }
-	if (c == 'd') { E.pending_op = OP_DELETE; return; }
-	if (c == 'y') { E.pending_op = OP_YANK; return; }
+	switch (c) {
+	case 'c': op = OP_CHANGE; break;
+	case 'd': op = OP_DELETE; break;
+	case 'y': op = OP_YANK; break;
+	}
+	if (op != OP_NONE && op != E.pending_op) {
+		E.pending_op = op;
+		return;
+	}
 
 handle_as_motion:
 	u32 count = E.pending_count ? E.pending_count : 1;
 	E.pending_count = 0;
 
 	pos_t start = { E.cx, E.cy };
-	pos_t end = run_motion(c, start, count);
+	pos_t end;
+	bool linewise;
+	if (op != OP_NONE) {
+		// A doubled operator (dd, yy, cc) works on 'count' whole lines
+		end = motion_down(start, count - 1);
+		linewise = true;
+	} else {
+		end = run_motion(c, start, count);
+		linewise = c < 128 && (motion_flags[c] & MF_LINEWISE);
+	}
+
+	// Like vi, "cw" on a word only changes up to its end
+	if (E.pending_op == OP_CHANGE && (c == 'w' || c == 'W') && !isspace((u8)get_char_at(start))) {
+		while (end.y > start.y || (end.y == start.y && end.x > start.x + 1)) {
+			pos_t prev = end.x ? (pos_t){ end.x - 1, end.y } : (pos_t){ UINT32_MAX, end.y - 1 };
+			if (prev.x == UINT32_MAX) prev.x = row_at(prev.y)->len;
+			if (!isspace((u8)get_char_at(prev)) && get_char_at(prev) != '\n') break;
+			end = prev;
+		}
+	} else if (E.pending_op != OP_NONE && (c == 'w' || c == 'W') && end.y > start.y && end.y < E.row_count) {
+		// ... and "dw" on the last word of a line stops at the end of it
+		end.y--;
+		end.x = row_at(end.y)->len;
+	}
 
 	if (E.pending_op != OP_NONE) {
 		switch (E.pending_op) {
-		case OP_CHANGE:	change_range(start, end); break;
-		case OP_DELETE:	delete_range(start, end); break;
-		case OP_YANK:	yank_range(start, end); break;
+		case OP_CHANGE:	change_range(start, end, linewise); break;
+		case OP_DELETE:	delete_range(start, end, linewise); break;
+		case OP_YANK:	yank_range(start, end, linewise); break;
 		}
 
 		E.pending_op = OP_NONE;
@@ -854,22 +4908,86 @@ handle_as_motion:
 	}
 }
 
+// Navigation keys act like the matching motion in NORMAL and INSERT mode
+// With wrapping a page is a screen of visual lines, which may all belong
+// to one long row, so the view moves and the cursor is kept inside it
+static void page_move(bool down) {
+	if (!E.wrap) {
+		E.pending_count = E.screen_rows;
+		process_normal(down ? 'j' : 'k');
+		return;
+	}
+
+	pos_t top = { E.row_sub, E.row_offset };
+	top = down ? vline_down(top, E.screen_rows) : vline_up(top, E.screen_rows);
+	E.row_offset = top.y;
+	E.row_sub = top.x;
+	if (E.cy >= E.row_count) return;
+
+	pos_t cur = { wrap_line(E.cy, row_col(E.cy, E.cx)), E.cy };
+	pos_t bottom = vline_down(top, E.screen_rows - 1);
+	if (cur.y < top.y || (cur.y == top.y && cur.x < top.x)) cur = top;
+	else if (cur.y > bottom.y || (cur.y == bottom.y && cur.x > bottom.x)) cur = bottom;
+	else return;
+
+	u32 start;
+	E.cy = cur.y;
+	E.cx = row_byte(cur.y, wrap_col(cur.y, cur.x), &start);
+}
+
+static bool process_navkey(u32 c) {
+	switch (c) {
+	case ARROW_UP: process_normal('k'); break;
+	case ARROW_DOWN: process_normal('j'); break;
+	case ARROW_LEFT: process_normal('h'); break;
+	case ARROW_RIGHT: process_normal('l'); break;
+	case HOME: process_normal('_'); break;
+	case END: process_normal('$'); break;
+	case PAGE_UP: page_move(false); break;
+	case PAGE_DOWN: page_move(true); break;
+	default: return false;
+	}
+	return true;
+}
+
 // TODO: Refactor this mess
 static void process_keypress(void) {
+	PERF_SCOPE(P_KEYPRESS);
 	u32 c = read_key();
 
+	// Nothing that changes the text gets through in a read-only buffer
+	if (E.view && E.mode == M_NORMAL && (c == CTRL_KEY('r') || (c < 128 && c != 0 && strchr("iIaAoOxXpPucd", c)))) {
+		E.pending_op = OP_NONE;
+		E.pending_count = 0;
+		statusmsg_set("Buffer is read-only");
+		return;
+	}
+
+	if (c == PASTE_BEGIN) {
+		if (E.mode == M_NORMAL || E.mode == M_INSERT) read_paste();
+		return;
+	}
+
 	if (E.mode == M_NORMAL) {
+		// Each command (and the INSERT session it leads into) is one undo step
+		if (E.pending_op == OP_NONE) undo_commit();
+
 		switch (c) {
 		case 'i': E.mode = M_INSERT; break;
 		case 'I': process_normal('_'); E.mode = M_INSERT; break;
 		case 'a': process_normal('l'); E.mode = M_INSERT; break;
 		case 'A': process_normal('$'); E.mode = M_INSERT; break;
-		case 'o': row_insert(++E.cy, "", 0); E.mode = M_INSERT; break;
-		case 'O': row_insert(E.cy, "", 0); E.mode = M_INSERT; break;
-		case 'x': process_normal('l');
-		case 'X': delete_char(); break;
+		case 'o': row_insert(++E.cy, "", 0); E.cx = 0; E.mode = M_INSERT; break;
+		case 'O': row_insert(E.cy, "", 0); E.cx = 0; E.mode = M_INSERT; break;
+		case 'x': delete_chars(false); break;
+		case 'X': delete_chars(true); break;
+		case 'p': put_register(false); break;
+		case 'P': put_register(true); break;
+		case 'u': undo_step(false); break;
+		case CTRL_KEY('r'): undo_step(true); break;
+		case CTRL_KEY('g'): file_info(); break;
 		case ':': E.mode = M_COMMAND; break;
-		default: process_normal(c); break;
+		default: if (!process_navkey(c)) process_normal(c); break;
 		}
 		pos_t fix = fix_toofar((pos_t){ E.cx, E.cy });
 		E.cx = fix.x;
@@ -881,7 +4999,7 @@ static void process_keypress(void) {
 	case DELETE: process_normal('l');
 	case BACKSPACE:
 	case CTRL_KEY('h'): delete_char(); break;
-	default: if (isprint((u8)c)) insert_char(c); break;
+	default: if (!process_navkey(c) && c < 128 && isprint(c)) insert_char(c); break;
 	}
 
 	if (E.mode == M_COMMAND) {
@@ -896,30 +5014,293 @@ static void process_keypress(void) {
  * Initialization & cleanup
  */
 static void cleanup_editor(void) {
-	write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7);
-	disable_raw();
-	for (u32 i = 0; i < E.row_count; i++) row_free(&E.rows[i]);
-	free(E.rows);
+	if (!E.headless) {
+		write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7);
+		disable_raw();
+	}
+	buffers_free();
+	swap_remove();
+	rows_free();
+	map_close();
+	undo_reset();
+	reg_free(&E.reg);
+	free(E.search_str);
+	free(E.search);
+	free(E.match_index);
+	screen_invalidate();
+	width_free();
+	ab_free(&E.frame);
+	ab_free(&E.line);
+	ab_free(&E.hl_buf);
 	free(E.filename);
 }
 
-static void init_editor(void) {
+static void update_winsize(void) {
+	u32 rows;
+	if (get_winsize(&rows, &E.screen_cols) != 0) die("get_winsize");
+	E.screen_rows = (rows > 2) ? rows - 2 : 1;
+}
+
+static void handle_resize(void) {
+	update_winsize();
+	screen_invalidate();
+	refresh_screen();
+}
+
+// A headless editor draws to whatever stdout is, as if it were an 80x24
+// terminal, and leaves the tty alone
+static void init_editor(bool headless) {
 	memset(&E, 0, sizeof(E));
-	enable_raw();
-	if (get_winsize(&E.screen_rows, &E.screen_cols) != 0) die("get_winsize");
-	E.screen_rows -= 2;
+	E.headless = headless;
+	E.width_gen = 1;
+	E.watch = -1;
+	E.swap = -1;
+	// Rows are taken to be UTF-8 whatever the locale says
+	if (!setlocale(LC_CTYPE, "") || strcmp(nl_langinfo(CODESET), "UTF-8") != 0) setlocale(LC_CTYPE, "C.UTF-8");
+	char* delay = getenv("ESCDELAY");
+	E.esc_timeout = delay ? atoi(delay) : ESC_TIMEOUT;
+
+	if (pipe2(E.wake_pipe, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe2");
+	struct sigaction sa = { .sa_handler = sigwinch_handler, .sa_flags = SA_RESTART };
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
+
+	if (headless) {
+		E.screen_rows = 22;
+		E.screen_cols = 80;
+	} else {
+		enable_raw();
+		update_winsize();
+	}
 	motions_init();
+	buffer_add();
 	atexit(cleanup_editor);
 }
 
-int main(int argc, char** argv) {
-	init_editor();
+#ifdef BENCH
+/*
+ * Benchmark replay
+ *
+ * Built by 'make bench', with allocations counted like for 'make perf'.
+ * A script of steps is replayed against
+ * each file given, with the keys of a step fed through a pipe standing in
+ * for the terminal, so they go through process_keypress() like typed ones.
+ * A step's time runs from its first key to the frame drawn after it.
+ *
+ *	open		open the file and draw the first frame
+ *	load		wait for the whole file to be read in
+ *	save		write the buffer next to the file (as FILE.saved)
+ *	keys NAME N KEYS	replay KEYS N times, timing each go as NAME
+ *
+ * KEYS may use \e, \r, \n, \t, \\ and \xHH escapes.
+ */
+#define BENCH_OPS	64
+
+struct bench_op {
+	char name[32];
+	u64* ns;
+	u32 count, cap;
+	u64 allocs;
+};
+
+static struct bench_op bench_ops[BENCH_OPS];
+static u32 bench_op_count;
+static int bench_keys = -1;
+
+static u64 bench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench_record(const char* name, u64 ns, u64 allocs) {
+	struct bench_op* op = NULL;
+	for (u32 i = 0; i < bench_op_count && !op; i++) if (strcmp(bench_ops[i].name, name) == 0) op = &bench_ops[i];
+	if (!op) {
+		if (bench_op_count == BENCH_OPS) return;
+		op = &bench_ops[bench_op_count++];
+		snprintf(op->name, sizeof(op->name), "%s", name);
+	}
+
+	if (op->count == op->cap) {
+		op->cap = op->cap ? op->cap * 2 : 64;
+		op->ns = realloc(op->ns, sizeof(*op->ns) * op->cap);
+		if (op->ns == NULL) die("realloc");
+	}
+	op->ns[op->count++] = ns;
+	op->allocs += allocs;
+}
 
+// Turn the escapes in s into the bytes they stand for, in place
+static u32 bench_unescape(char* s) {
+	u32 n = 0;
+	for (char* p = s; *p; p++) {
+		if (*p != '\\' || p[1] == '\0') {
+			s[n++] = *p;
+			continue;
+		}
+		switch (*++p) {
+		case 'e': s[n++] = '\x1b'; break;
+		case 'r': s[n++] = '\r'; break;
+		case 'n': s[n++] = '\n'; break;
+		case 't': s[n++] = '\t'; break;
+		case 'x': {
+			char hex[3] = { p[1], p[1] ? p[2] : 0, 0 };
+			s[n++] = strtoul(hex, NULL, 16);
+			p += strlen(hex);
+			break;
+		}
+		default: s[n++] = *p; break;
+		}
+	}
+	return n;
+}
+
+// Type keys in and let the editor work through them, the way main() does
+static void bench_type(const char* keys, u32 len) {
+	while (len > 0) {
+		ssize_t n = write(bench_keys, keys, len);
+		if (n == -1 && errno != EAGAIN) die("write");
+		if (n > 0) {
+			keys += n;
+			len -= n;
+		}
+		while (input_pending()) process_keypress();
+	}
+	match_start();
+	refresh_screen();
+}
+
+static int bench_cmp(const void* a, const void* b) {
+	u64 x = *(const u64*)a, y = *(const u64*)b;
+	return (x > y) - (x < y);
+}
+
+static void bench_report(FILE* out, const char* file) {
+	fprintf(out, "%s\n%-16s %8s %10s %10s %10s %10s %10s\n", file, "op", "n", "p50 us", "p90 us", "p99 us", "max us", "allocs/op");
+	for (u32 i = 0; i < bench_op_count; i++) {
+		struct bench_op* op = &bench_ops[i];
+		qsort(op->ns, op->count, sizeof(*op->ns), bench_cmp);
+		u64 p50 = op->ns[(op->count - 1) / 2], p90 = op->ns[(op->count - 1) * 9 / 10];
+		u64 p99 = op->ns[(op->count - 1) * 99 / 100], max = op->ns[op->count - 1];
+		fprintf(out, "%-16s %8u %10.1f %10.1f %10.1f %10.1f %10.1f\n", op->name, op->count,
+			p50 / 1e3, p90 / 1e3, p99 / 1e3, max / 1e3, (double)op->allocs / op->count);
+		free(op->ns);
+	}
+	fprintf(out, "\n");
+	memset(bench_ops, 0, sizeof(bench_ops));
+	bench_op_count = 0;
+}
+
+static void bench_run(FILE* script, char* file) {
+	char* line = NULL;
+	size_t cap = 0;
+	rewind(script);
+	while (getline(&line, &cap, script) != -1) {
+		line[strcspn(line, "\n")] = '\0';
+		char* cmd = strtok(line, " \t");
+		if (cmd == NULL || cmd[0] == '#') continue;
+
+		char name[32];
+		u32 reps = 1, len = 0;
+		char* keys = NULL;
+		if (strcmp(cmd, "keys") == 0) {
+			char* n = strtok(NULL, " \t");
+			char* r = strtok(NULL, " \t");
+			keys = strtok(NULL, "");
+			if (!n || !r || !keys) {
+				fprintf(stderr, "bad step: keys NAME N KEYS\n");
+				exit(1);
+			}
+			snprintf(name, sizeof(name), "%s", n);
+			reps = strtoul(r, NULL, 10);
+			len = bench_unescape(keys);
+		} else snprintf(name, sizeof(name), "%s", cmd);
+
+		for (u32 i = 0; i < reps; i++) {
+			u64 allocs = alloc_count, t = bench_now();
+			if (strcmp(cmd, "open") == 0) {
+				open_file(file);
+				refresh_screen();
+			} else if (strcmp(cmd, "load") == 0) {
+				index_wait(UINT32_MAX);
+			} else if (strcmp(cmd, "save") == 0) {
+				char* path = malloc(strlen(file) + 7);
+				if (path == NULL) die("malloc");
+				sprintf(path, "%s.saved", file);
+				save_file(path, true);
+				unlink(path);
+				free(path);
+			} else if (keys) {
+				bench_type(keys, len);
+			} else {
+				fprintf(stderr, "unknown step '%s'\n", cmd);
+				exit(1);
+			}
+			bench_record(name, bench_now() - t, alloc_count - allocs);
+		}
+	}
+	free(line);
+}
+
+static int bench_replay(char* path, int argc, char** argv) {
+	FILE* script = fopen(path, "r");
+	if (script == NULL) die(path);
+
+	// Frames go to /dev/null and the report to what stdout was
+	FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+	int null = open("/dev/null", O_WRONLY);
+	int keys[2];
+	if (out == NULL || null == -1 || pipe2(keys, O_NONBLOCK) == -1) die("bench");
+	dup2(null, STDOUT_FILENO);
+	dup2(keys[0], STDIN_FILENO);
+	fcntl(keys[1], F_SETPIPE_SZ, 1 << 20);
+	bench_keys = keys[1];
+
+	init_editor(true);
+	E.esc_timeout = 0;
+	for (int i = 0; i < argc; i++) {
+		bench_run(script, argv[i]);
+		bench_report(out, argv[i]);
+		fflush(out);
+	}
+	fclose(script);
+	return 0;
+}
+#endif
+
+int main(int argc, char** argv) {
+#ifdef BENCH
+	if (argc >= 3 && strcmp(argv[1], "--replay") == 0) return bench_replay(argv[2], argc - 3, argv + 3);
+#endif
+#ifdef PERF
+	if (argc >= 3 && strcmp(argv[1], "--trace") == 0) {
+		perf_trace(argv[2]);
+		argc -= 2;
+		argv += 2;
+	}
+#endif
+	init_editor(false);
+
+	// -R views the file read-only, -F follows it as well
+	if (argc >= 3 && (strcmp(argv[1], "-R") == 0 || strcmp(argv[1], "-F") == 0)) {
+		E.view = true;
+		E.follow = argv[1][1] == 'F';
+		argc--;
+		argv++;
+	}
 	if (argc >= 2) open_file(argv[1]);
+	if (E.follow) {
+		index_wait(UINT32_MAX);
+		E.cy = E.row_count - (E.row_count > 0);
+	}
 
+	// Apply everything that's already queued up before drawing again
 	while (1) {
+		view_trim();
+		match_start();
 		refresh_screen();
-		process_keypress();
+		do process_keypress(); while (input_pending());
 	}
 }
 